@@ -1,22 +1,59 @@
+#include <stddef.h>
 #include <stdlib.h>
 
 #include <stdio.h>
 #include <string.h>
 
+#if defined(TCL_ENABLE_STATS) || !defined(TCL_DISABLE_EVENTS)
+#include <time.h>
+#endif
+
+/* The event loop sleeps in poll() where it's available */
+#if !defined(TCL_DISABLE_EVENTS) && (defined(__unix__) || defined(__APPLE__))
+#include <poll.h>
+#include <sys/time.h>
+#define TCL_POLL
+#endif
+
+#if !defined(TCL_DISABLE_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TCL_SIMD
+#endif
+
+/* Interpreter pools share compiled scripts between threads, that needs C11
+ * atomics. Without them clones of one snapshot must be created and destroyed
+ * by one thread. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L &&               \
+    !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define TCL_ATOMICS
+#endif
+
+#if !defined(TCL_DISABLE_POOL) && defined(TCL_ATOMICS)
+#define TCL_POOL
+#endif
+
+#if !defined(TEST) && !defined(TCL_DISABLE_IMAGE) &&                           \
+    (defined(__unix__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TCL_MMAP
+#endif
+
 #if 0
 #define DBG printf
 #else
 #define DBG(...)
 #endif
 
-#define MAX_VAR_LENGTH 256
-
 struct tcl;
 int tcl_eval(struct tcl *tcl, const char *s, size_t len);
 
 /* Token type and control flow constants */
 enum { TCMD, TWORD, TPART, TERROR };
-enum { FERROR, FNORMAL, FRETURN, FBREAK, FAGAIN };
+enum { FERROR, FNORMAL, FRETURN, FBREAK, FAGAIN, FCALL, FYIELD };
 
 static int tcl_is_special(char c, int q) {
   return (c == '$' || (!q && (c == '{' || c == '}' || c == ';' || c == '\r' ||
@@ -30,12 +67,112 @@ static int tcl_is_end(char c) {
   return (c == '\n' || c == '\r' || c == ';' || c == '\0');
 }
 
+/* Characters that end a word part inside and outside of quotes */
+static const char tcl_stop_q[] = {'$', '[', ']', '"', '\0'};
+static const char tcl_stop[] = {'$', '[',  ']',  '"',  '\0', ' ',
+                                '\t', '{', '}', ';', '\r', '\n'};
+
+/* Returns the index of the first character of s that belongs to the set, or
+ * n if there is none. Long tokens (braced bodies, data) are scanned 16 or 32
+ * bytes at a time if SIMD is available. */
+static size_t tcl_find_scalar(const char *s, size_t n, const char *set,
+                              int nset) {
+  for (size_t i = 0; i < n; i++) {
+    for (int k = 0; k < nset; k++) {
+      if (s[i] == set[k]) {
+        return i;
+      }
+    }
+  }
+  return n;
+}
+
+#ifdef TCL_SIMD
+static size_t tcl_find_sse2(const char *s, size_t n, const char *set,
+                            int nset) {
+  __m128i v[sizeof(tcl_stop)];
+  size_t i = 0;
+  for (int k = 0; k < nset; k++) {
+    v[k] = _mm_set1_epi8(set[k]);
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m = _mm_cmpeq_epi8(b, v[0]);
+    for (int k = 1; k < nset; k++) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(b, v[k]));
+    }
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + tcl_find_scalar(s + i, n - i, set, nset);
+}
+
+__attribute__((target("avx2"))) static size_t
+tcl_find_avx2(const char *s, size_t n, const char *set, int nset) {
+  __m256i v[sizeof(tcl_stop)];
+  size_t i = 0;
+  for (int k = 0; k < nset; k++) {
+    v[k] = _mm256_set1_epi8(set[k]);
+  }
+  for (; i + 32 <= n; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m = _mm256_cmpeq_epi8(b, v[0]);
+    for (int k = 1; k < nset; k++) {
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, v[k]));
+    }
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + tcl_find_sse2(s + i, n - i, set, nset);
+}
+
+/* The CPU features are checked once, before any thread is started */
+static int tcl_avx2 = 0;
+
+__attribute__((constructor)) static void tcl_simd_init(void) {
+  __builtin_cpu_init();
+  tcl_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+static size_t tcl_find(const char *s, size_t n, const char *set, int nset) {
+  /* Most tokens are short, vectors only pay off for longer ones */
+  size_t i = tcl_find_scalar(s, n < 16 ? n : 16, set, nset);
+  if (i < 16 || i == n) {
+    return i;
+  }
+#ifdef TCL_SIMD
+  if (tcl_avx2) {
+    return i + tcl_find_avx2(s + i, n - i, set, nset);
+  }
+  return i + tcl_find_sse2(s + i, n - i, set, nset);
+#else
+  return i + tcl_find_scalar(s + i, n - i, set, nset);
+#endif
+}
+
+/* Counts nested braces (or brackets) until the depth drops to zero, returns
+ * the index after the closing character or n if it's not found */
+static size_t tcl_find_close(const char *s, size_t n, char open, int *depth) {
+  char set[2] = {open, (open == '[' ? ']' : '}')};
+  size_t i = 0;
+  while (i < n && *depth != 0) {
+    i = i + tcl_find(s + i, n - i, set, 2);
+    if (i < n) {
+      *depth = *depth + (s[i] == open ? 1 : -1);
+      i++;
+    }
+  }
+  return i;
+}
+
 int tcl_next(const char *s, size_t n, const char **from, const char **to,
              int *q) {
-  unsigned int i = 0;
-  int depth = 0;
-  char open;
-  char close;
+  size_t i = 0;
 
   DBG("tcl_next(%.*s)+%d+%d|%d\n", n, s, *from - s, *to - s, *q);
 
@@ -61,15 +198,8 @@ int tcl_next(const char *s, size_t n, const char **from, const char **to,
 
   if (*s == '[' || (!*q && *s == '{')) {
     /* Interleaving pairs are not welcome, but it simplifies the code */
-    open = *s;
-    close = (open == '[' ? ']' : '}');
-    for (i = 0, depth = 1; i < n && depth != 0; i++) {
-      if (i > 0 && s[i] == open) {
-        depth++;
-      } else if (s[i] == close) {
-        depth--;
-      }
-    }
+    int depth = 1;
+    i = (n > 0 ? 1 + tcl_find_close(s + 1, n - 1, *s, &depth) : 0);
   } else if (*s == '"') {
     *q = !*q;
     *from = *to = s + 1;
@@ -84,10 +214,10 @@ int tcl_next(const char *s, size_t n, const char **from, const char **to,
   } else if (*s == ']' || *s == '}') {
     /* Unbalanced bracket or brace */
     return TERROR;
+  } else if (*q) {
+    i = tcl_find(s, n, tcl_stop_q, sizeof(tcl_stop_q));
   } else {
-    while (i < n && (*q || !tcl_is_space(s[i])) && !tcl_is_special(s[i], *q)) {
-      i++;
-    }
+    i = tcl_find(s, n, tcl_stop, sizeof(tcl_stop));
   }
   *to = s + i;
   if (i == n) {
@@ -121,559 +251,4026 @@ struct tcl_parser {
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
-typedef char tcl_value_t;
+/* Memory allocator: realloc(ctx, NULL, size) allocates a new block,
+ * realloc(ctx, ptr, 0) frees it. Every interpreter has its own allocator, the
+ * default one uses malloc/realloc/free. */
+struct tcl_allocator {
+  void *(*realloc)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+};
 
-const char *tcl_string(tcl_value_t *v) { return v; }
-int tcl_int(tcl_value_t *v) { return atoi(v); }
-int tcl_length(tcl_value_t *v) { return v == NULL ? 0 : strlen(v); }
+static void *tcl_heap_realloc(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
 
-void tcl_free(tcl_value_t *v) { free(v); }
+struct tcl_allocator tcl_heap = {tcl_heap_realloc, NULL};
 
-tcl_value_t *tcl_append_string(tcl_value_t *v, const char *s, size_t len) {
-  size_t n = tcl_length(v);
-  v = realloc(v, n + len + 1);
-  memset((char *)tcl_string(v) + n, 0, len + 1);
-  strncpy((char *)tcl_string(v) + n, s, len);
-  return v;
+/* Interpreters may run in different threads, so the allocator state is per
+ * thread. Older standards rely on compiler extensions. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L &&               \
+    !defined(__STDC_NO_THREADS__)
+#define TCL_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define TCL_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define TCL_THREAD_LOCAL __declspec(thread)
+#else
+#define TCL_THREAD_LOCAL
+#endif
+
+/* Allocator for new values. While a script is evaluated it's the allocator
+ * (or the arena) of the interpreter that evaluates it, otherwise it's the
+ * heap: host code outside of an evaluation uses tcl_alloc_in() instead. */
+static TCL_THREAD_LOCAL struct tcl_allocator *tcl_mem = &tcl_heap;
+
+#ifdef TCL_ENABLE_STATS
+/* Number of allocated blocks, used for per-command statistics */
+static TCL_THREAD_LOCAL unsigned long tcl_nallocs = 0;
+#define TCL_COUNT_ALLOC(ptr) (tcl_nallocs += ((ptr) == NULL))
+#else
+#define TCL_COUNT_ALLOC(ptr)
+#endif
+
+static void *tcl_realloc(struct tcl_allocator *mem, void *ptr, size_t size) {
+  TCL_COUNT_ALLOC(ptr);
+  return mem->realloc(mem->ctx, ptr, size);
 }
 
-tcl_value_t *tcl_append(tcl_value_t *v, tcl_value_t *tail) {
-  v = tcl_append_string(v, tcl_string(tail), tcl_length(tail));
-  tcl_free(tail);
-  return v;
+static void *tcl_malloc(struct tcl_allocator *mem, size_t size) {
+  TCL_COUNT_ALLOC(NULL);
+  return mem->realloc(mem->ctx, NULL, size);
 }
 
-tcl_value_t *tcl_alloc(const char *s, size_t len) {
-  return tcl_append_string(NULL, s, len);
+static void *tcl_calloc(struct tcl_allocator *mem, size_t size) {
+  TCL_COUNT_ALLOC(NULL);
+  return memset(mem->realloc(mem->ctx, NULL, size), 0, size);
 }
 
-tcl_value_t *tcl_dup(tcl_value_t *v) {
-  return tcl_alloc(tcl_string(v), tcl_length(v));
+static void tcl_mfree(struct tcl_allocator *mem, void *ptr) {
+  if (ptr != NULL) {
+    mem->realloc(mem->ctx, ptr, 0);
+  }
 }
 
-tcl_value_t *tcl_list_alloc(void) { return tcl_alloc("", 0); }
+/* Arena for short-lived values created while a command is evaluated. Memory
+ * is bump-allocated from a list of chunks, freeing a block does nothing and
+ * all the blocks are released at once when the command completes. */
+struct tcl_chunk {
+  struct tcl_chunk *next;
+  size_t size;
+  size_t top;
+  char data[];
+};
 
-int tcl_list_length(tcl_value_t *v) {
-  int count = 0;
-  tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
-    if (p.token == TWORD) {
-      count++;
+struct tcl_arena {
+  struct tcl_allocator mem;
+  struct tcl_allocator *heap;
+  struct tcl_chunk *chunks;
+  struct tcl_chunk *cur;
+  size_t chunk;
+};
+
+struct tcl_mark {
+  struct tcl_chunk *cur;
+  size_t top;
+};
+
+static void *tcl_arena_realloc(void *ctx, void *ptr, size_t size) {
+  struct tcl_arena *a = (struct tcl_arena *)ctx;
+  size_t need = sizeof(size_t) + ((size + 7) & ~(size_t)7);
+  struct tcl_chunk *c = a->cur;
+  if (size == 0) {
+    return NULL;
+  }
+  while (c == NULL || c->top + need > c->size) {
+    struct tcl_chunk *next = (c == NULL ? a->chunks : c->next);
+    if (next == NULL || next->size < need) {
+      size_t n = (need > a->chunk ? need : a->chunk);
+      struct tcl_chunk *fresh = tcl_malloc(a->heap, sizeof(*fresh) + n);
+      fresh->size = n;
+      fresh->next = next;
+      if (c == NULL) {
+        a->chunks = fresh;
+      } else {
+        c->next = fresh;
+      }
+      next = fresh;
     }
+    next->top = 0;
+    c = next;
   }
-  return count;
+  a->cur = c;
+  size_t *block = (size_t *)(void *)(c->data + c->top);
+  c->top += need;
+  *block = size;
+  if (ptr != NULL) {
+    size_t old = ((size_t *)ptr)[-1];
+    memcpy(block + 1, ptr, old < size ? old : size);
+  }
+  return block + 1;
 }
 
-void tcl_list_free(tcl_value_t *v) { free(v); }
+static struct tcl_mark tcl_arena_mark(struct tcl_arena *a) {
+  struct tcl_mark m = {NULL, 0};
+  if (a != NULL && a->cur != NULL) {
+    m.cur = a->cur;
+    m.top = a->cur->top;
+  }
+  return m;
+}
 
-tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
-  int i = 0;
-  tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
-    if (p.token == TWORD) {
-      if (i == index) {
-        if (p.from[0] == '{') {
-          return tcl_alloc(p.from + 1, p.to - p.from - 2);
-        }
-        return tcl_alloc(p.from, p.to - p.from);
-      }
-      i++;
+static void tcl_arena_release(struct tcl_arena *a, struct tcl_mark m) {
+  if (a != NULL) {
+    a->cur = m.cur;
+    if (m.cur != NULL) {
+      m.cur->top = m.top;
     }
   }
-  return NULL;
 }
 
-tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
-  if (tcl_length(v) > 0) {
-    v = tcl_append(v, tcl_alloc(" ", 2));
-  }
-  if (tcl_length(tail) > 0) {
-    int q = 0;
-    const char *p;
-    for (p = tcl_string(tail); *p; p++) {
-      if (tcl_is_space(*p) || tcl_is_special(*p, 0)) {
-        q = 1;
-        break;
-      }
-    }
-    if (q) {
-      v = tcl_append(v, tcl_alloc("{", 1));
-    }
-    v = tcl_append(v, tcl_dup(tail));
-    if (q) {
-      v = tcl_append(v, tcl_alloc("}", 1));
-    }
-  } else {
-    v = tcl_append(v, tcl_alloc("{}", 2));
+static void tcl_arena_free(struct tcl_arena *a) {
+  while (a->chunks != NULL) {
+    struct tcl_chunk *c = a->chunks;
+    a->chunks = c->next;
+    tcl_mfree(a->heap, c);
   }
-  return v;
 }
 
-/* ----------------------------- */
-/* ----------------------------- */
-/* ----------------------------- */
-/* ----------------------------- */
+/* Internal representations of values are never kept in the arena */
+static struct tcl_allocator *tcl_heap_of(struct tcl_allocator *mem) {
+  if (mem->realloc == tcl_arena_realloc) {
+    return ((struct tcl_arena *)mem->ctx)->heap;
+  }
+  return mem;
+}
 
-typedef int (*tcl_cmd_fn_t)(struct tcl *, tcl_value_t *, void *);
+/* Values are reference-counted strings that may also cache an internal
+ * representation (integer, list, compiled script or expression). The internal
+ * representation is computed lazily and dropped when the string changes.
+ * Lists are the opposite: items are kept in an array and the string is only
+ * built when it's requested, until then the string pointer is NULL.
+ * Frozen values (negative reference count) belong to code that is shared
+ * between interpreters: they are never modified, freed or given a new
+ * internal representation.
+ * A slice borrows its bytes from the string of a parent value, which it keeps
+ * alive. Slices aren't terminated, so tcl_string() copies the bytes into the
+ * value when it's called, and code that can work with a length uses the
+ * borrowed bytes directly.
+ * Short strings are kept inline in the value, so they need no allocation of
+ * their own. */
+enum { TCL_STRING, TCL_INT, TCL_LIST, TCL_CODE, TCL_EXPR };
 
-struct tcl_cmd {
-  tcl_value_t *name;
-  int arity;
-  tcl_cmd_fn_t fn;
-  void *arg;
-  struct tcl_cmd *next;
-};
+#ifndef TCL_SMALL_STRING
+#define TCL_SMALL_STRING 16
+#endif
 
-struct tcl_var {
-  tcl_value_t *name;
-  tcl_value_t *value;
-  struct tcl_var *next;
-};
+/* The string was built lazily and lives on the heap, even for arena values */
+#define TCL_SHEAP 1
+/* Literal that was a braced word in the script */
+#define TCL_BRACED 2
 
-struct tcl_env {
-  struct tcl_var *vars;
-  struct tcl_env *parent;
+struct tcl_code;
+static void tcl_code_free(struct tcl_code *code);
+#ifndef TCL_DISABLE_MATH
+struct tcl_expr;
+static void tcl_expr_free(struct tcl_expr *expr);
+#endif
+
+typedef struct tcl_value tcl_value_t;
+struct tcl_value {
+  int refs;
+  int type;
+  int flags;
+  size_t len;
+  size_t cap;
+  char *s;
+  struct tcl_allocator *mem;
+  tcl_value_t *parent;
+  union {
+    long long i;
+    struct {
+      tcl_value_t **items;
+      int n;
+    } list;
+    struct tcl_code *code;
+    struct tcl_expr *expr;
+  } rep;
+  char small[TCL_SMALL_STRING];
 };
 
-static struct tcl_env *tcl_env_alloc(struct tcl_env *parent) {
-  struct tcl_env *env = malloc(sizeof(*env));
-  env->vars = NULL;
-  env->parent = parent;
-  return env;
-}
+/* Immortal values that are returned instead of new ones: the empty string and
+ * small integers. Like all frozen values they are never modified or freed. */
+#define TCL_INT_CONST(n)                                                       \
+  { .refs = -1, .type = TCL_INT, .len = sizeof(#n) - 1, .s = (char *)#n,       \
+    .rep = {.i = n} }
+#define TCL_INT_CONSTS(d)                                                      \
+  TCL_INT_CONST(d##0), TCL_INT_CONST(d##1), TCL_INT_CONST(d##2),               \
+      TCL_INT_CONST(d##3), TCL_INT_CONST(d##4), TCL_INT_CONST(d##5),           \
+      TCL_INT_CONST(d##6), TCL_INT_CONST(d##7), TCL_INT_CONST(d##8),           \
+      TCL_INT_CONST(d##9)
 
-static struct tcl_var *tcl_env_var(struct tcl_env *env, tcl_value_t *name) {
-  struct tcl_var *var = malloc(sizeof(struct tcl_var));
-  var->name = tcl_dup(name);
-  var->next = env->vars;
-  var->value = tcl_alloc("", 0);
-  env->vars = var;
-  return var;
-}
+static tcl_value_t tcl_empty = {.refs = -1, .type = TCL_STRING, .s = ""};
+static tcl_value_t tcl_ints[] = {
+    TCL_INT_CONSTS(),  TCL_INT_CONSTS(1), TCL_INT_CONSTS(2), TCL_INT_CONSTS(3),
+    TCL_INT_CONSTS(4), TCL_INT_CONSTS(5), TCL_INT_CONSTS(6), TCL_INT_CONSTS(7),
+    TCL_INT_CONSTS(8), TCL_INT_CONSTS(9)};
 
-static struct tcl_env *tcl_env_free(struct tcl_env *env) {
-  struct tcl_env *parent = env->parent;
-  while (env->vars) {
-    struct tcl_var *var = env->vars;
-    env->vars = env->vars->next;
-    tcl_free(var->name);
-    tcl_free(var->value);
-    free(var);
-  }
-  free(env);
-  return parent;
-}
+void tcl_free(tcl_value_t *v);
 
-struct tcl {
-  struct tcl_env *env;
-  struct tcl_cmd *cmds;
-  tcl_value_t *result;
-};
+static struct tcl_allocator *tcl_smem(tcl_value_t *v) {
+  return (v->flags & TCL_SHEAP) ? tcl_heap_of(v->mem) : v->mem;
+}
 
-tcl_value_t *tcl_var(struct tcl *tcl, tcl_value_t *name, tcl_value_t *v) {
-  DBG("var(%s := %.*s)\n", tcl_string(name), tcl_length(v), tcl_string(v));
-  struct tcl_var *var;
-  for (var = tcl->env->vars; var != NULL; var = var->next) {
-    if (strcmp(var->name, tcl_string(name)) == 0) {
-      break;
+static void tcl_free_rep(tcl_value_t *v) {
+  if (v->type == TCL_LIST) {
+    for (int i = 0; i < v->rep.list.n; i++) {
+      tcl_free(v->rep.list.items[i]);
     }
+    tcl_mfree(tcl_heap_of(v->mem), v->rep.list.items);
+  } else if (v->type == TCL_CODE) {
+    tcl_code_free(v->rep.code);
+#ifndef TCL_DISABLE_MATH
+  } else if (v->type == TCL_EXPR) {
+    tcl_expr_free(v->rep.expr);
+#endif
   }
-  if (var == NULL) {
-    var = tcl_env_var(tcl->env, name);
-  }
-  if (v != NULL) {
-    tcl_free(var->value);
-    var->value = tcl_dup(v);
-    tcl_free(v);
-  }
-  return var->value;
+  v->type = TCL_STRING;
 }
 
-int tcl_result(struct tcl *tcl, int flow, tcl_value_t *result) {
-  DBG("tcl_result %.*s, flow=%d\n", tcl_length(result), tcl_string(result),
-      flow);
-  tcl_free(tcl->result);
-  tcl->result = result;
-  return flow;
-}
+static int tcl_list_quote(tcl_value_t *item);
 
-int tcl_subst(struct tcl *tcl, const char *s, size_t len) {
-  DBG("subst(%.*s)\n", (int)len, s);
-  if (len == 0) {
-    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+/* Builds the string form of a list */
+static void tcl_list_string(tcl_value_t *v) {
+  size_t len = 0;
+  for (int i = 0; i < v->rep.list.n; i++) {
+    tcl_value_t *item = v->rep.list.items[i];
+    int q = tcl_list_quote(item);
+    len = len + (i > 0) + q * 2 + item->len;
   }
-  switch (s[0]) {
-  case '{':
-    if (len <= 1) {
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  if (len < sizeof(v->small)) {
+    v->cap = sizeof(v->small);
+    v->s = v->small;
+  } else {
+    if (v->mem->realloc == tcl_arena_realloc) {
+      v->flags |= TCL_SHEAP;
     }
-    return tcl_result(tcl, FNORMAL, tcl_alloc(s + 1, len - 2));
-  case '$': {
-    if (len >= MAX_VAR_LENGTH) {
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+    v->cap = len + 1;
+    v->s = tcl_malloc(tcl_smem(v), v->cap);
+  }
+  char *p = v->s;
+  for (int i = 0; i < v->rep.list.n; i++) {
+    tcl_value_t *item = v->rep.list.items[i];
+    int q = tcl_list_quote(item);
+    if (i > 0) {
+      *p++ = ' ';
+    }
+    if (q) {
+      *p++ = '{';
+    }
+    memcpy(p, item->s, item->len);
+    p += item->len;
+    if (q) {
+      *p++ = '}';
     }
-    char buf[5 + MAX_VAR_LENGTH] = "set ";
-    strncat(buf, s + 1, len - 1);
-    return tcl_eval(tcl, buf, strlen(buf) + 1);
   }
-  case '[': {
-    tcl_value_t *expr = tcl_alloc(s + 1, len - 2);
-    int r = tcl_eval(tcl, tcl_string(expr), tcl_length(expr) + 1);
-    tcl_free(expr);
-    return r;
+  *p = '\0';
+  v->len = len;
+}
+
+/* Returns the string bytes, which are not terminated if the value is a slice.
+ * The bytes are valid until the value is changed or converted to a string. */
+static const char *tcl_bytes(tcl_value_t *v) {
+  if (v->s == NULL) {
+    tcl_list_string(v);
   }
-  default:
-    return tcl_result(tcl, FNORMAL, tcl_alloc(s, len));
+  return v->s;
+}
+
+/* Releases the string of the value, or the parent of a slice */
+static void tcl_free_string(tcl_value_t *v) {
+  if (v->parent != NULL) {
+    tcl_free(v->parent);
+  } else if (v->s != v->small) {
+    tcl_mfree(tcl_smem(v), v->s);
   }
 }
 
-int tcl_eval(struct tcl *tcl, const char *s, size_t len) {
-  DBG("eval(%.*s)->\n", (int)len, s);
-  tcl_value_t *list = tcl_list_alloc();
-  tcl_value_t *cur = NULL;
-  tcl_each(s, len, 1) {
-    DBG("tcl_next %d %.*s\n", p.token, (int)(p.to - p.from), p.from);
-    switch (p.token) {
-    case TERROR:
-      DBG("eval: FERROR, lexer error\n");
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
-    case TWORD:
-      DBG("token %.*s, length=%d, cur=%p (3.1.1)\n", (int)(p.to - p.from),
-          p.from, (int)(p.to - p.from), cur);
-      if (cur != NULL) {
-        tcl_subst(tcl, p.from, p.to - p.from);
-        tcl_value_t *part = tcl_dup(tcl->result);
-        cur = tcl_append(cur, part);
-      } else {
-        tcl_subst(tcl, p.from, p.to - p.from);
-        cur = tcl_dup(tcl->result);
+const char *tcl_string(tcl_value_t *v) {
+  if (v != NULL && v->parent != NULL && v->s[v->len] != '\0') {
+    /* Slices that end with the parent string are terminated already */
+    tcl_value_t *parent = v->parent;
+    char *s = v->small;
+    v->cap = sizeof(v->small);
+    if (v->len >= sizeof(v->small)) {
+      if (v->mem->realloc == tcl_arena_realloc) {
+        /* Like a list string, it may be built after the value was created */
+        v->flags |= TCL_SHEAP;
       }
-      list = tcl_list_append(list, cur);
-      tcl_free(cur);
-      cur = NULL;
-      break;
-    case TPART:
-      tcl_subst(tcl, p.from, p.to - p.from);
-      tcl_value_t *part = tcl_dup(tcl->result);
-      cur = tcl_append(cur, part);
-      break;
-    case TCMD:
-      if (tcl_list_length(list) == 0) {
-        tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
-      } else {
-        tcl_value_t *cmdname = tcl_list_at(list, 0);
-        struct tcl_cmd *cmd = NULL;
-        int r = FERROR;
-        for (cmd = tcl->cmds; cmd != NULL; cmd = cmd->next) {
-          if (strcmp(tcl_string(cmdname), tcl_string(cmd->name)) == 0) {
-            if (cmd->arity == 0 || cmd->arity == tcl_list_length(list)) {
-              r = cmd->fn(tcl, list, cmd->arg);
-              break;
-            }
-          }
-        }
-        tcl_free(cmdname);
-        if (cmd == NULL || r != FNORMAL) {
-          tcl_list_free(list);
-          return r;
-        }
-      }
-      tcl_list_free(list);
-      list = tcl_list_alloc();
-      break;
+      v->cap = v->len + 1;
+      s = tcl_malloc(tcl_smem(v), v->cap);
     }
+    v->s = memcpy(s, v->s, v->len);
+    v->s[v->len] = '\0';
+    v->parent = NULL;
+    tcl_free(parent);
   }
-  tcl_list_free(list);
-  return FNORMAL;
+  return v == NULL ? NULL : tcl_bytes(v);
 }
 
-/* --------------------------------- */
-/* --------------------------------- */
-/* --------------------------------- */
-/* --------------------------------- */
-/* --------------------------------- */
-void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity,
-                  void *arg) {
-  struct tcl_cmd *cmd = malloc(sizeof(struct tcl_cmd));
-  cmd->name = tcl_alloc(name, strlen(name));
-  cmd->fn = fn;
-  cmd->arg = arg;
-  cmd->arity = arity;
-  cmd->next = tcl->cmds;
-  tcl->cmds = cmd;
+int tcl_length(tcl_value_t *v) {
+  return v == NULL ? 0 : (tcl_bytes(v), (int)v->len);
 }
 
-static int tcl_cmd_set(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  tcl_value_t *var = tcl_list_at(args, 1);
-  tcl_value_t *val = tcl_list_at(args, 2);
-  int r = tcl_result(tcl, FNORMAL, tcl_dup(tcl_var(tcl, var, val)));
-  tcl_free(var);
-  return r;
+long long tcl_wide(tcl_value_t *v) {
+  if (v->type != TCL_INT) {
+    char buf[32];
+    const char *s = tcl_bytes(v);
+    if (v->parent != NULL && v->len < sizeof(buf)) {
+      /* Numbers are short, they are parsed without copying the slice */
+      memcpy(buf, s, v->len);
+      buf[v->len] = '\0';
+      s = buf;
+    } else {
+      s = tcl_string(v);
+    }
+    long long i = atoll(s);
+    if (v->refs < 0) {
+      return i;
+    }
+    tcl_free_rep(v);
+    v->type = TCL_INT;
+    v->rep.i = i;
+  }
+  return v->rep.i;
 }
 
-static int tcl_cmd_subst(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  tcl_value_t *s = tcl_list_at(args, 1);
-  int r = tcl_subst(tcl, tcl_string(s), tcl_length(s));
-  tcl_free(s);
-  return r;
-}
+int tcl_int(tcl_value_t *v) { return (int)tcl_wide(v); }
 
-#ifndef TCL_DISABLE_PUTS
-static int tcl_cmd_puts(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  tcl_value_t *text = tcl_list_at(args, 1);
-  puts(tcl_string(text));
-  putchar('\n');
-  return tcl_result(tcl, FNORMAL, text);
+void tcl_free(tcl_value_t *v) {
+  if (v != NULL && v->refs > 0 && --v->refs == 0) {
+    tcl_free_rep(v);
+    tcl_free_string(v);
+    tcl_mfree(v->mem, v);
+  }
 }
-#endif
 
-static int tcl_user_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  tcl_value_t *code = (tcl_value_t *)arg;
-  tcl_value_t *params = tcl_list_at(code, 2);
-  tcl_value_t *body = tcl_list_at(code, 3);
-  tcl->env = tcl_env_alloc(tcl->env);
-  for (int i = 0; i < tcl_list_length(params); i++) {
-    tcl_value_t *param = tcl_list_at(params, i);
-    tcl_value_t *v = tcl_list_at(args, i + 1);
-    tcl_var(tcl, param, v);
-    tcl_free(param);
+static tcl_value_t *tcl_alloc_mem(struct tcl_allocator *mem, const char *s,
+                                  size_t len) {
+  tcl_value_t *v = tcl_malloc(mem, sizeof(tcl_value_t));
+  v->refs = 1;
+  v->type = TCL_STRING;
+  v->flags = 0;
+  v->mem = mem;
+  v->len = len;
+  if (len < sizeof(v->small)) {
+    v->cap = sizeof(v->small);
+    v->s = v->small;
+  } else {
+    v->cap = len + 1;
+    v->s = tcl_malloc(mem, v->cap);
   }
-  tcl_eval(tcl, tcl_string(body), tcl_length(body) + 1);
-  tcl->env = tcl_env_free(tcl->env);
-  tcl_free(params);
-  tcl_free(body);
-  return FNORMAL;
+  v->parent = NULL;
+  memcpy(v->s, s, len);
+  v->s[len] = '\0';
+  return v;
 }
 
-static int tcl_cmd_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  tcl_value_t *name = tcl_list_at(args, 1);
-  tcl_register(tcl, tcl_string(name), tcl_user_proc, 0, tcl_dup(args));
-  tcl_free(name);
-  return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+/* Returns a slice of the parent string, or a copy if the parent is frozen,
+ * keeps the string inline or lives in the arena while the slice doesn't */
+static tcl_value_t *tcl_slice(struct tcl_allocator *mem, tcl_value_t *parent,
+                              const char *s, size_t len) {
+  if (parent->refs < 0) {
+    /* Frozen values may be used by many threads, so the reference count of
+     * the value they slice is not touched */
+    if (s == parent->s && len == parent->len) {
+      return parent;
+    }
+    return tcl_alloc_mem(mem, s, len);
+  }
+  if (parent->parent != NULL) {
+    parent = parent->parent;
+  }
+  if (parent->refs < 0 || parent->s == parent->small ||
+      (parent->mem->realloc == tcl_arena_realloc &&
+       mem->realloc != tcl_arena_realloc)) {
+    return tcl_alloc_mem(mem, s, len);
+  }
+  tcl_value_t *v = tcl_malloc(mem, sizeof(tcl_value_t));
+  v->refs = 1;
+  v->type = TCL_STRING;
+  v->flags = 0;
+  v->mem = mem;
+  v->len = len;
+  v->cap = 0;
+  v->s = (char *)s;
+  v->parent = parent;
+  parent->refs++;
+  return v;
 }
 
-static int tcl_cmd_if(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  int i = 1;
-  int n = tcl_list_length(args);
-  int r = FNORMAL;
-  while (i < n) {
-    tcl_value_t *cond = tcl_list_at(args, i);
-    tcl_value_t *branch = NULL;
-    if (i + 1 < n) {
-      branch = tcl_list_at(args, i + 1);
-    }
-    r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
-    tcl_free(cond);
-    if (r != FNORMAL) {
-      tcl_free(branch);
-      break;
+/* Makes the value writable and ensures it has room for len more bytes. The
+ * buffer grows geometrically, so building a string by appending is linear. */
+static tcl_value_t *tcl_grow(tcl_value_t *v, size_t len) {
+  if (v == NULL || v->refs != 1 || v->parent != NULL) {
+    /* Shared values and slices are never modified in place */
+    tcl_value_t *copy =
+        tcl_alloc_mem(tcl_mem, v == NULL ? "" : tcl_bytes(v), tcl_length(v));
+    tcl_free(v);
+    v = copy;
+  }
+  tcl_string(v);
+  tcl_free_rep(v);
+  if (v->len + len + 1 > v->cap) {
+    size_t cap = v->cap * 2;
+    if (cap < v->len + len + 1) {
+      cap = v->len + len + 1;
     }
-    if (tcl_int(tcl->result)) {
-      r = tcl_eval(tcl, tcl_string(branch), tcl_length(branch) + 1);
-      tcl_free(branch);
-      break;
+    if (v->s == v->small) {
+      v->s = memcpy(tcl_malloc(tcl_smem(v), cap), v->small, v->len + 1);
+    } else {
+      v->s = tcl_realloc(tcl_smem(v), v->s, cap);
     }
-    i = i + 2;
-    tcl_free(branch);
+    v->cap = cap;
   }
-  return r;
+  return v;
 }
 
-static int tcl_cmd_flow(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  int r = FERROR;
-  tcl_value_t *flowval = tcl_list_at(args, 0);
-  const char *flow = tcl_string(flowval);
-  if (strcmp(flow, "break") == 0) {
-    r = FBREAK;
-  } else if (strcmp(flow, "continue") == 0) {
+/* Grows an array of list items, capacity is 4 or the next power of two */
+static tcl_value_t **tcl_grow_items(struct tcl_allocator *mem,
+                                    tcl_value_t **items, int n) {
+  if (items == NULL) {
+    return tcl_malloc(mem, 4 * sizeof(tcl_value_t *));
+  }
+  if (n >= 4 && (n & (n - 1)) == 0) {
+    return tcl_realloc(mem, items, n * 2 * sizeof(tcl_value_t *));
+  }
+  return items;
+}
+
+tcl_value_t *tcl_append_string(tcl_value_t *v, const char *s, size_t len) {
+  v = tcl_grow(v, len);
+  memcpy(v->s + v->len, s, len);
+  v->len += len;
+  v->s[v->len] = '\0';
+  return v;
+}
+
+tcl_value_t *tcl_append(tcl_value_t *v, tcl_value_t *tail) {
+  v = tcl_append_string(v, tail == NULL ? "" : tcl_bytes(tail),
+                        tcl_length(tail));
+  tcl_free(tail);
+  return v;
+}
+
+tcl_value_t *tcl_alloc(const char *s, size_t len) {
+  return len == 0 ? &tcl_empty : tcl_alloc_mem(tcl_mem, s, len);
+}
+
+/* Formats a number, the value keeps it as the integer representation */
+tcl_value_t *tcl_alloc_wide(long long i) {
+  if (i >= 0 && i < (long long)(sizeof(tcl_ints) / sizeof(tcl_ints[0]))) {
+    return &tcl_ints[i];
+  }
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  unsigned long long u = (unsigned long long)i;
+  if (i < 0) {
+    u = 0 - u;
+  }
+  do {
+    *--p = '0' + (u % 10);
+    u = u / 10;
+  } while (u > 0);
+  if (i < 0) {
+    *--p = '-';
+  }
+  tcl_value_t *v = tcl_alloc(p, buf + sizeof(buf) - p);
+  v->type = TCL_INT;
+  v->rep.i = i;
+  return v;
+}
+
+tcl_value_t *tcl_dup(tcl_value_t *v) {
+  if (v == NULL) {
+    return tcl_alloc("", 0);
+  }
+  if (v->refs > 0) {
+    v->refs++;
+  }
+  return v;
+}
+
+/* Moves a value out of the arena, so that it can outlive the command */
+tcl_value_t *tcl_keep(tcl_value_t *v) {
+  if (v == NULL || v->refs < 0 || v->mem->realloc != tcl_arena_realloc) {
+    return v;
+  }
+  tcl_value_t *copy =
+      tcl_alloc_mem(tcl_heap_of(v->mem), tcl_bytes(v), tcl_length(v));
+  if (v->type == TCL_INT) {
+    copy->type = TCL_INT;
+    copy->rep.i = v->rep.i;
+  }
+  tcl_free(v);
+  return copy;
+}
+
+static tcl_value_t *tcl_list_new(struct tcl_allocator *mem, int n) {
+  tcl_value_t *v = tcl_malloc(mem, sizeof(tcl_value_t));
+  v->refs = 1;
+  v->type = TCL_LIST;
+  v->flags = 0;
+  v->mem = mem;
+  v->len = v->cap = 0;
+  v->s = NULL;
+  v->parent = NULL;
+  v->rep.list.n = 0;
+  v->rep.list.items = NULL;
+  if (n > 0) {
+    v->rep.list.items =
+        tcl_malloc(tcl_heap_of(mem), (n < 4 ? 4 : n) * sizeof(tcl_value_t *));
+  }
+  return v;
+}
+
+tcl_value_t *tcl_list_alloc(void) { return tcl_list_new(tcl_mem, 0); }
+
+static void tcl_list_rep(tcl_value_t *v) {
+  if (v->type == TCL_LIST) {
+    return;
+  }
+  struct tcl_allocator *mem = tcl_heap_of(v->mem);
+  tcl_value_t **items = NULL;
+  int n = 0;
+  const char *s = tcl_string(v);
+  if (v->parent == NULL && v->s != v->small &&
+      v->mem->realloc != tcl_arena_realloc) {
+    /* Items are slices of the string, which moves into a parent of its own,
+     * so that the items don't keep the list alive */
+    tcl_value_t *parent = tcl_malloc(mem, sizeof(tcl_value_t));
+    *parent = *v;
+    parent->refs = 1;
+    parent->type = TCL_STRING;
+    parent->flags = 0;
+    v->parent = parent;
+    v->cap = 0;
+  }
+  tcl_each(s, v->len + 1, 0) {
+    if (p.token == TWORD) {
+      int braced = (p.from[0] == '{');
+      items = tcl_grow_items(mem, items, n);
+      items[n++] = tcl_slice(mem, v, p.from + braced,
+                             p.to - p.from - 2 * braced);
+    }
+  }
+  tcl_free_rep(v);
+  v->type = TCL_LIST;
+  v->rep.list.items = items;
+  v->rep.list.n = n;
+}
+
+/* Returns a reference to the value with a list representation. Frozen values
+ * can't keep the parsed list, so a temporary copy is parsed instead. */
+static tcl_value_t *tcl_list_get(tcl_value_t *v) {
+  if (v->refs < 0 && v->type != TCL_LIST) {
+    v = tcl_alloc_mem(tcl_mem, tcl_string(v), tcl_length(v));
+  } else {
+    v = tcl_dup(v);
+  }
+  tcl_list_rep(v);
+  return v;
+}
+
+int tcl_list_length(tcl_value_t *v) {
+  v = tcl_list_get(v);
+  int n = v->rep.list.n;
+  tcl_free(v);
+  return n;
+}
+
+void tcl_list_free(tcl_value_t *v) { tcl_free(v); }
+
+tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
+  tcl_value_t *item = NULL;
+  v = tcl_list_get(v);
+  if (index >= 0 && index < v->rep.list.n) {
+    item = tcl_dup(v->rep.list.items[index]);
+  }
+  tcl_free(v);
+  return item;
+}
+
+/* Items that are empty or contain special characters are put into braces */
+static int tcl_list_quote(tcl_value_t *item) {
+  const char *s = tcl_bytes(item);
+  if (item->len == 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < item->len; i++) {
+    if (tcl_is_space(s[i]) || tcl_is_special(s[i], 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
+  if (v->refs < 0) {
+    v = tcl_alloc_mem(tcl_mem, tcl_string(v), tcl_length(v));
+  }
+  tcl_list_rep(v);
+  if (v->refs > 1) {
+    /* Shared lists are copied, items are shared */
+    tcl_value_t *copy = tcl_list_new(tcl_mem, v->rep.list.n);
+    for (int i = 0; i < v->rep.list.n; i++) {
+      copy->rep.list.items[i] = tcl_dup(v->rep.list.items[i]);
+    }
+    copy->rep.list.n = v->rep.list.n;
+    tcl_free(v);
+    v = copy;
+  }
+  /* The string form is built again when it's needed */
+  tcl_free_string(v);
+  v->s = NULL;
+  v->parent = NULL;
+  v->len = v->cap = 0;
+  v->flags &= ~TCL_SHEAP;
+  int n = v->rep.list.n;
+  v->rep.list.items = tcl_grow_items(tcl_heap_of(v->mem), v->rep.list.items, n);
+  v->rep.list.items[n] = tcl_dup(tail);
+  if (v->mem->realloc != tcl_arena_realloc) {
+    v->rep.list.items[n] = tcl_keep(v->rep.list.items[n]);
+  }
+  v->rep.list.n = n + 1;
+  return v;
+}
+
+/* ----------------------------- */
+/* ----------------------------- */
+/* ----------------------------- */
+/* ----------------------------- */
+
+/* Compiled scripts. Each script is lexed once into a flat stream of opcodes:
+ * OP_PUSH pushes a literal, OP_LOAD pushes the value of a variable with a
+ * literal name, OP_VAR replaces the name on top of the stack with the variable
+ * value, OP_SUB evaluates a nested [script] and pushes its result, OP_CAT
+ * joins N parts into one word and OP_INVOKE calls a command with N words.
+ * OP_ERROR marks the place where the lexer failed. OP_TAIL is OP_SUB for the
+ * single command of "return [cmd ...]", which may become a tail call. */
+enum { OP_PUSH, OP_LOAD, OP_VAR, OP_SUB, OP_CAT, OP_INVOKE, OP_ERROR, OP_TAIL };
+
+#ifndef TCL_CODE_CACHE
+#define TCL_CODE_CACHE 64
+#endif
+
+#ifndef TCL_EXPR_CACHE
+#define TCL_EXPR_CACHE 16
+#endif
+
+/* Each OP_INVOKE refers to a call site, which remembers the resolved command
+ * if the command name is a literal. The cached command is valid as long as
+ * the interpreter command epoch doesn't change. */
+struct tcl_site {
+  int words;
+  int named;
+  struct tcl *tcl;
+  unsigned int epoch;
+  struct tcl_cmd *cmd;
+};
+
+/* Each OP_LOAD remembers the local slot of the variable in the procedure
+ * where it was last executed */
+struct tcl_vsite {
+  int lit;
+  struct tcl_proc *proc;
+  int slot;
+};
+
+struct tcl_code {
+  int refs;
+  struct tcl_allocator *mem;
+  int *ops;
+  int nops;
+  int depth;
+  tcl_value_t **lits;
+  int nlits;
+  struct tcl_code **subs;
+  int nsubs;
+  struct tcl_site *sites;
+  int nsites;
+  struct tcl_vsite *vsites;
+  int nvsites;
+  /* Source text, used as a key in the per-interpreter code cache. Literals
+   * are slices of it. */
+  tcl_value_t *src;
+  size_t len;
+  unsigned int hash;
+};
+
+/* Frozen code is shared by the interpreters of a pool and is never freed */
+static struct tcl_code *tcl_code_dup(struct tcl_code *code) {
+  if (code->refs > 0) {
+    code->refs++;
+  }
+  return code;
+}
+
+static void tcl_code_free(struct tcl_code *code) {
+  if (code == NULL || code->refs < 0 || --code->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < code->nlits; i++) {
+    tcl_free(code->lits[i]);
+  }
+  for (int i = 0; i < code->nsubs; i++) {
+    tcl_code_free(code->subs[i]);
+  }
+  tcl_mfree(code->mem, code->lits);
+  tcl_mfree(code->mem, code->subs);
+  tcl_mfree(code->mem, code->sites);
+  tcl_mfree(code->mem, code->vsites);
+  tcl_mfree(code->mem, code->ops);
+  tcl_free(code->src);
+  tcl_mfree(code->mem, code);
+}
+
+static void tcl_emit(struct tcl_code *code, int op, int arg, int *sp) {
+  code->ops = tcl_realloc(code->mem, code->ops, (code->nops + 2) * sizeof(int));
+  code->ops[code->nops++] = op;
+  code->ops[code->nops++] = arg;
+  switch (op) {
+  case OP_PUSH:
+  case OP_LOAD:
+  case OP_SUB:
+    *sp = *sp + 1;
+    break;
+  case OP_CAT:
+    *sp = *sp - arg + 1;
+    break;
+  case OP_INVOKE:
+    *sp = *sp - code->sites[arg].words;
+    break;
+  }
+  if (*sp > code->depth) {
+    code->depth = *sp;
+  }
+}
+
+static void tcl_emit_lit(struct tcl_code *code, const char *s, size_t len,
+                         int *sp) {
+  code->lits = tcl_realloc(code->mem, code->lits,
+                           (code->nlits + 1) * sizeof(tcl_value_t *));
+  code->lits[code->nlits] = (code->src == NULL || len == 0)
+                               ? tcl_alloc_mem(code->mem, s, len)
+                               : tcl_slice(code->mem, code->src, s, len);
+  tcl_emit(code, OP_PUSH, code->nlits++, sp);
+}
+
+static void tcl_emit_invoke(struct tcl_code *code, int words, int named,
+                            int *sp) {
+  code->sites = tcl_realloc(code->mem, code->sites,
+                            (code->nsites + 1) * sizeof(struct tcl_site));
+  memset(&code->sites[code->nsites], 0, sizeof(struct tcl_site));
+  code->sites[code->nsites].words = words;
+  code->sites[code->nsites].named = named;
+  tcl_emit(code, OP_INVOKE, code->nsites++, sp);
+}
+
+static struct tcl_code *tcl_compile(struct tcl_allocator *mem, const char *s,
+                                    size_t len, tcl_value_t *src);
+
+/* Compiles a single word part, following the substitution rules */
+static void tcl_compile_part(struct tcl_code *code, const char *s, size_t len,
+                             int *sp) {
+  if (len == 0) {
+    tcl_emit_lit(code, "", 0, sp);
+    return;
+  }
+  switch (s[0]) {
+  case '{':
+    tcl_emit_lit(code, s + 1, len < 2 ? 0 : len - 2, sp);
+    code->lits[code->nlits - 1]->flags |= TCL_BRACED;
+    break;
+  case '$':
+    tcl_compile_part(code, s + 1, len - 1, sp);
+    if (code->ops[code->nops - 2] == OP_PUSH) {
+      /* Literal variable name */
+      code->vsites =
+          tcl_realloc(code->mem, code->vsites,
+                      (code->nvsites + 1) * sizeof(struct tcl_vsite));
+      code->vsites[code->nvsites].lit = code->ops[code->nops - 1];
+      code->vsites[code->nvsites].proc = NULL;
+      code->vsites[code->nvsites].slot = 0;
+      code->ops[code->nops - 2] = OP_LOAD;
+      code->ops[code->nops - 1] = code->nvsites++;
+    } else {
+      tcl_emit(code, OP_VAR, 0, sp);
+    }
+    break;
+  case '[': {
+    /* The lexer needs a terminated copy of the nested script */
+    tcl_value_t *expr = tcl_alloc_mem(code->mem, s + 1, len - 2);
+    code->subs = tcl_realloc(code->mem, code->subs,
+                             (code->nsubs + 1) * sizeof(struct tcl_code *));
+    code->subs[code->nsubs] =
+        tcl_compile(code->mem, expr->s, expr->len + 1, expr);
+    tcl_free(expr);
+    tcl_emit(code, OP_SUB, code->nsubs++, sp);
+    break;
+  }
+  default:
+    tcl_emit_lit(code, s, len, sp);
+    break;
+  }
+}
+
+/* Compiles a terminated script. If the source value is given, the code keeps
+ * it and literals are slices of it, otherwise they are copies. */
+static struct tcl_code *tcl_compile(struct tcl_allocator *mem, const char *s,
+                                    size_t len, tcl_value_t *src) {
+  DBG("compile(%.*s)\n", (int)len, s);
+  struct tcl_code *code = tcl_calloc(mem, sizeof(struct tcl_code));
+  int sp = 0;
+  int words = 0;
+  int parts = 0;
+  int named = 0;
+  code->refs = 1;
+  code->mem = mem;
+  code->src = (src == NULL ? NULL : tcl_dup(src));
+  tcl_each(s, len, 1) {
+    switch (p.token) {
+    case TERROR:
+      tcl_emit(code, OP_ERROR, 0, &sp);
+      return code;
+    case TWORD:
+      tcl_compile_part(code, p.from, p.to - p.from, &sp);
+      if (parts > 0) {
+        tcl_emit(code, OP_CAT, parts + 1, &sp);
+      } else if (words == 0) {
+        named = (code->ops[code->nops - 2] == OP_PUSH);
+      }
+      parts = 0;
+      words++;
+      break;
+    case TPART:
+      tcl_compile_part(code, p.from, p.to - p.from, &sp);
+      parts++;
+      break;
+    case TCMD:
+      if (words == 2 && named && code->ops[code->nops - 2] == OP_SUB &&
+          code->ops[code->nops - 4] == OP_PUSH &&
+          strcmp(tcl_string(code->lits[code->ops[code->nops - 3]]),
+                 "return") == 0) {
+        struct tcl_code *sub = code->subs[code->ops[code->nops - 1]];
+        if (sub->nsites == 1 && sub->ops[sub->nops - 2] == OP_INVOKE) {
+          code->ops[code->nops - 2] = OP_TAIL;
+        }
+      }
+      tcl_emit_invoke(code, words, named, &sp);
+      words = 0;
+      named = 0;
+      break;
+    }
+  }
+  return code;
+}
+
+static unsigned int tcl_hash(const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* Compiles a script of len - 1 bytes that may be followed by anything instead
+ * of the terminator. The source is copied once, literals are its slices. */
+static struct tcl_code *tcl_compile_source(struct tcl_allocator *mem,
+                                           const char *s, size_t len,
+                                           unsigned int h) {
+  tcl_value_t *src = tcl_alloc_mem(mem, s, len > 0 ? len - 1 : 0);
+  struct tcl_code *code = tcl_compile(mem, src->s, src->len + 1, src);
+  tcl_free(src);
+  code->len = len;
+  code->hash = h;
+  return code;
+}
+
+/* Compares a compiled script with a source, see tcl_compile_source() */
+static int tcl_code_is(struct tcl_code *code, const char *s, size_t len,
+                       unsigned int h) {
+  return code->hash == h && code->len == len && code->src != NULL &&
+         memcmp(code->src->s, s, code->src->len) == 0;
+}
+
+/* Makes the code immutable, so that it can be shared between threads. Since
+ * frozen literals can't cache anything, their internal representation is
+ * prepared in advance: numbers are parsed and braced words (conditions, loop
+ * and procedure bodies) are compiled. Call sites don't cache commands. */
+static void tcl_code_freeze(struct tcl_code *code) {
+  code->refs = -1;
+  for (int i = 0; i < code->nlits; i++) {
+    tcl_value_t *v = code->lits[i];
+    /* Frozen literals own their strings */
+    tcl_string(v);
+    if (v->flags & TCL_BRACED) {
+      v->type = TCL_CODE;
+      v->rep.code = tcl_compile(code->mem, v->s, v->len + 1, NULL);
+      tcl_code_freeze(v->rep.code);
+    } else if ((v->s[0] >= '0' && v->s[0] <= '9') || v->s[0] == '-') {
+      v->type = TCL_INT;
+      v->rep.i = atoll(v->s);
+    }
+    v->refs = -1;
+  }
+  for (int i = 0; i < code->nsubs; i++) {
+    tcl_code_freeze(code->subs[i]);
+  }
+}
+
+/* Makes frozen code reference-counted again, so that it can be freed */
+static void tcl_code_thaw(struct tcl_code *code) {
+  code->refs = 1;
+  for (int i = 0; i < code->nlits; i++) {
+    code->lits[i]->refs = 1;
+    if (code->lits[i]->type == TCL_CODE) {
+      tcl_code_thaw(code->lits[i]->rep.code);
+    }
+  }
+  for (int i = 0; i < code->nsubs; i++) {
+    tcl_code_thaw(code->subs[i]);
+  }
+}
+
+#ifdef TCL_POOL
+#ifndef TCL_POOL_CACHE
+#define TCL_POOL_CACHE 256
+#endif
+
+/* Pool of interpreters that share compiled scripts. A script is compiled and
+ * frozen once for all interpreters of the pool. The cache is an open
+ * addressing table that is only added to: a slot is filled with
+ * compare-and-swap and never changes afterwards, so lookups take no locks.
+ * Idle interpreters are kept in a list protected by a spinlock. */
+struct tcl_pool {
+  struct tcl_allocator *mem;
+  void (*init)(struct tcl *tcl, void *arg);
+  void *arg;
+  atomic_flag lock;
+  struct tcl *idle;
+  _Atomic(struct tcl_code *) cache[TCL_POOL_CACHE];
+};
+
+/* Returns the shared compiled script, or NULL if the cache is full */
+static struct tcl_code *tcl_pool_code(struct tcl_pool *pool, const char *s,
+                                      size_t len, unsigned int h) {
+  struct tcl_code *fresh = NULL;
+  struct tcl_code *code = NULL;
+  for (int i = 0; i < TCL_POOL_CACHE; i++) {
+    _Atomic(struct tcl_code *) *slot = &pool->cache[(h + i) % TCL_POOL_CACHE];
+    code = atomic_load_explicit(slot, memory_order_acquire);
+    if (code == NULL) {
+      if (fresh == NULL) {
+        fresh = tcl_compile_source(pool->mem, s, len, h);
+        tcl_code_freeze(fresh);
+      }
+      if (atomic_compare_exchange_strong_explicit(slot, &code, fresh,
+                                                  memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+        return fresh;
+      }
+      /* Another thread has filled the slot first */
+    }
+    if (tcl_code_is(code, s, len, h)) {
+      break;
+    }
+    code = NULL;
+  }
+  if (fresh != NULL) {
+    tcl_code_thaw(fresh);
+    tcl_code_free(fresh);
+  }
+  return code;
+}
+#endif
+
+typedef int (*tcl_cmd_fn_t)(struct tcl *, tcl_value_t *, void *);
+/* Commands registered with tcl_register_argv() get the words of the command
+ * as an array, the values are owned by the caller */
+typedef int (*tcl_argv_fn_t)(struct tcl *, int, tcl_value_t **, void *);
+
+#ifdef TCL_ENABLE_STATS
+/* Execution statistics of a command, times are in nanoseconds and include
+ * the nested commands */
+struct tcl_stats {
+  unsigned long calls;
+  unsigned long long time;
+  unsigned long long max;
+  unsigned long allocs;
+};
+#endif
+
+/* Interned command or variable name. A name is stored once in the chain of
+ * snapshots that an interpreter was cloned from, so names are compared by
+ * pointer. Unused names are removed, names of a snapshot are frozen. */
+struct tcl_name {
+  int refs;
+  unsigned int hash;
+  struct tcl_name *next;
+  size_t len;
+  char s[];
+};
+
+struct tcl_cmd {
+  struct tcl_name *name;
+  int arity;
+  tcl_cmd_fn_t fn;
+  tcl_argv_fn_t argv_fn;
+  void *arg;
+  struct tcl_cmd *next;
+#ifdef TCL_ENABLE_STATS
+  struct tcl_stats stats;
+#endif
+};
+
+#ifdef TCL_ENABLE_STATS
+/* Statistics that a clone keeps for a command of its snapshot. Clones may
+ * run in different threads, so they don't write to the shared command. */
+struct tcl_shadow {
+  struct tcl_cmd *cmd;
+  struct tcl_stats stats;
+  struct tcl_shadow *next;
+};
+#define TCL_SHADOWS 32
+#endif
+
+struct tcl_var {
+  struct tcl_name *name;
+  tcl_value_t *value;
+  struct tcl_var *next;
+};
+
+/* User procedure, prepared when the procedure is defined: the body is
+ * compiled, parameters and the variables that the body refers to literally
+ * are resolved, each of them gets a slot in the call frame. */
+struct tcl_proc {
+  tcl_value_t *body;
+  struct tcl_name **locals;
+  int nlocals;
+  int nparams;
+};
+
+/* Call frame. Local slots are carved from a per-interpreter value stack,
+ * other variables are kept in a list. */
+struct tcl_env {
+  struct tcl_var *vars;
+  struct tcl_env *parent;
+  struct tcl_proc *proc;
+  int base;
+};
+
+/* Scripts are evaluated without recursion on the C stack. Each running
+ * script has a frame with its own value stack, frames are bump-allocated
+ * from a per-interpreter stack. A [script] substitution runs in a child
+ * frame whose result is pushed onto the parent stack. A command that needs
+ * to evaluate a script (if, while, procedures) returns FCALL from tcl_then()
+ * and its words stay on the stack until next(tcl, flow, argc, argv, state)
+ * is called with the flow of that script, which either completes the
+ * command or evaluates another script. */
+typedef int (*tcl_next_fn_t)(struct tcl *tcl, int flow, int argc,
+                             tcl_value_t **argv, int state);
+
+#ifndef TCL_MAX_DEPTH
+#define TCL_MAX_DEPTH 100000
+#endif
+
+/* The frame result is the word of a substitution */
+#define TCL_FRAME_SUB 1
+/* The frame evaluates the command of "return [cmd ...]" in a procedure */
+#define TCL_FRAME_TAIL 2
+
+struct tcl_frame {
+  struct tcl_frame *parent;
+  struct tcl_mark pos;
+  struct tcl_mark start;
+  struct tcl_code *code;
+  int pc;
+  int sp;
+  int flags;
+  /* Command that waits for the child frame */
+  tcl_next_fn_t next;
+  int state;
+  int argc;
+#ifdef TCL_ENABLE_STATS
+  struct tcl_stats *stats;
+  unsigned long long time;
+  unsigned long allocs;
+#endif
+  tcl_value_t *stack[];
+};
+
+#ifndef TCL_DISABLE_EVENTS
+typedef void (*tcl_event_fn_t)(struct tcl *tcl, void *arg);
+typedef void (*tcl_wait_fn_t)(struct tcl *tcl, long ms, void *arg);
+
+/* Pending event: a script, or a C function posted by the host */
+struct tcl_event {
+  unsigned long long when;
+  unsigned long id;
+  tcl_value_t *script;
+  tcl_event_fn_t fn;
+  void *arg;
+};
+
+/* Heap index of a pending event, found by the event id */
+struct tcl_event_pos {
+  unsigned long id;
+  int i;
+};
+#endif
+
+/* Commands are kept in a hash table with separate chaining, newer commands
+ * come first in the chain and shadow the older ones */
+struct tcl {
+  struct tcl_allocator *mem;
+  struct tcl_arena *arena;
+  struct tcl_env *env;
+  struct tcl_env *frames;
+  tcl_value_t **slots;
+  int nslots;
+  int capslots;
+  struct tcl_cmd **cmds;
+  int nbuckets;
+  int ncmds;
+  struct tcl_name **names;
+  int namebuckets;
+  int nnames;
+  unsigned int epoch;
+  tcl_value_t *result;
+  struct tcl_code *cache[TCL_CODE_CACHE];
+  /* Evaluation frames and the script requested by tcl_then() */
+  struct tcl_arena stack;
+  int depth;
+  struct tcl_coro *coro;
+  struct {
+    struct tcl_code *code;
+    tcl_next_fn_t next;
+    int state;
+  } call;
+#ifndef TCL_DISABLE_EVENTS
+  struct tcl_event *events;
+  int nevents;
+  int capevents;
+  unsigned long nextevent;
+  struct tcl_event_pos *eventpos;
+  /* Global variable that vwait waits for */
+  struct tcl_name *watch;
+  int changed;
+  tcl_wait_fn_t waiter;
+  void *waiterarg;
+#endif
+  /* Snapshot that this interpreter was cloned from */
+  struct tcl *parent;
+  int frozen;
+  /* Values frozen by tcl_snapshot(), they are freed with the interpreter */
+  tcl_value_t **snap;
+  int nsnap;
+  /* Number of clones, the snapshot can't be evaluated while they exist */
+#ifdef TCL_ATOMICS
+  atomic_int clones;
+#else
+  int clones;
+#endif
+#ifdef TCL_ENABLE_STATS
+  struct tcl_shadow *shadows[TCL_SHADOWS];
+#endif
+#ifdef TCL_POOL
+  struct tcl_pool *pool;
+  struct tcl *next;
+#endif
+#ifndef TCL_DISABLE_MATH
+  /* Expressions compiled from frozen values, indexed by the value address */
+  struct {
+    tcl_value_t *v;
+    struct tcl_expr *expr;
+  } exprs[TCL_EXPR_CACHE];
+#endif
+};
+
+/* Coroutines are scripts that can be suspended by "yield" and resumed by the
+ * host later. A suspended coroutine keeps its frames and local variables, but
+ * not the C stack, so an interpreter may have many coroutines in flight.
+ * While a coroutine runs its state is swapped into the interpreter. */
+struct tcl_coro {
+  struct tcl_frame *top;
+  struct tcl_arena stack;
+  struct tcl_arena *arena;
+  struct tcl_env *env;
+  tcl_value_t **slots;
+  int nslots;
+  int capslots;
+  int depth;
+};
+
+/* Finds an interned name in the interpreter or in its snapshots */
+static struct tcl_name *tcl_name_find(struct tcl *tcl, const char *s,
+                                      size_t len, unsigned int h) {
+  for (; tcl != NULL; tcl = tcl->parent) {
+    struct tcl_name *name =
+        (tcl->names == NULL ? NULL : tcl->names[h & (tcl->namebuckets - 1)]);
+    for (; name != NULL; name = name->next) {
+      if (name->hash == h && name->len == len &&
+          memcmp(name->s, s, len) == 0) {
+        return name;
+      }
+    }
+  }
+  return NULL;
+}
+
+static struct tcl_name *tcl_name_dup(struct tcl_name *name) {
+  if (name->refs > 0) {
+    name->refs++;
+  }
+  return name;
+}
+
+/* Returns a reference to the interned name, adding it if it's new */
+static struct tcl_name *tcl_intern(struct tcl *tcl, const char *s,
+                                   size_t len) {
+  unsigned int h = tcl_hash(s, len);
+  struct tcl_name *name = tcl_name_find(tcl, s, len, h);
+  if (name != NULL) {
+    return tcl_name_dup(name);
+  }
+  if (tcl->nnames >= tcl->namebuckets) {
+    /* The table is allocated with the first name, clones may need none */
+    int n = (tcl->namebuckets == 0 ? 32 : tcl->namebuckets * 2);
+    struct tcl_name **names =
+        tcl_calloc(tcl->mem, n * sizeof(struct tcl_name *));
+    for (int i = 0; i < tcl->namebuckets; i++) {
+      while (tcl->names[i] != NULL) {
+        struct tcl_name *next = tcl->names[i]->next;
+        tcl->names[i]->next = names[tcl->names[i]->hash & (n - 1)];
+        names[tcl->names[i]->hash & (n - 1)] = tcl->names[i];
+        tcl->names[i] = next;
+      }
+    }
+    tcl_mfree(tcl->mem, tcl->names);
+    tcl->names = names;
+    tcl->namebuckets = n;
+  }
+  struct tcl_name **head = &tcl->names[h & (tcl->namebuckets - 1)];
+  name = tcl_malloc(tcl->mem, sizeof(struct tcl_name) + len + 1);
+  name->refs = 1;
+  name->hash = h;
+  name->len = len;
+  memcpy(name->s, s, len);
+  name->s[len] = '\0';
+  name->next = *head;
+  *head = name;
+  tcl->nnames++;
+  return name;
+}
+
+/* Drops a reference to the name, the last one removes it from the table */
+static void tcl_name_free(struct tcl *tcl, struct tcl_name *name) {
+  if (name->refs > 0 && --name->refs == 0) {
+    struct tcl_name **p = &tcl->names[name->hash & (tcl->namebuckets - 1)];
+    while (*p != name) {
+      p = &(*p)->next;
+    }
+    *p = name->next;
+    tcl->nnames--;
+    tcl_mfree(tcl->mem, name);
+  }
+}
+
+static struct tcl_env *tcl_env_alloc(struct tcl *tcl, struct tcl_proc *proc) {
+  struct tcl_env *env = tcl->frames;
+  int n = (proc == NULL ? 0 : proc->nlocals);
+  if (env != NULL) {
+    tcl->frames = env->parent;
+  } else {
+    env = tcl_malloc(tcl->mem, sizeof(*env));
+  }
+  if (tcl->nslots + n > tcl->capslots) {
+    tcl->capslots = (tcl->nslots + n) * 2;
+    tcl->slots = tcl_realloc(tcl->mem, tcl->slots,
+                             tcl->capslots * sizeof(tcl_value_t *));
+  }
+  for (int i = 0; i < n; i++) {
+    tcl->slots[tcl->nslots + i] = NULL;
+  }
+  env->vars = NULL;
+  env->parent = tcl->env;
+  env->proc = proc;
+  env->base = tcl->nslots;
+  tcl->nslots += n;
+  return env;
+}
+
+static struct tcl_var *tcl_env_var(struct tcl *tcl, struct tcl_env *env,
+                                   struct tcl_name *name) {
+  struct tcl_var *var = tcl_malloc(tcl->mem, sizeof(struct tcl_var));
+  var->name = name;
+  var->next = env->vars;
+  var->value = &tcl_empty;
+  env->vars = var;
+  return var;
+}
+
+/* Releases the frame back to the interpreter, returns the parent frame */
+static struct tcl_env *tcl_env_free(struct tcl *tcl, struct tcl_env *env) {
+  struct tcl_env *parent = env->parent;
+  while (env->vars) {
+    struct tcl_var *var = env->vars;
+    env->vars = env->vars->next;
+    tcl_name_free(tcl, var->name);
+    tcl_free(var->value);
+    tcl_mfree(tcl->mem, var);
+  }
+  while (tcl->nslots > env->base) {
+    tcl_free(tcl->slots[--tcl->nslots]);
+  }
+  env->parent = tcl->frames;
+  tcl->frames = env;
+  return parent;
+}
+
+/* Finds a global variable of a snapshot, or of the snapshot it was cloned
+ * from. Snapshot values are frozen, so they can be shared without copying. */
+static tcl_value_t *tcl_global(struct tcl *tcl, struct tcl_name *name) {
+  for (; tcl != NULL; tcl = tcl->parent) {
+    for (struct tcl_var *var = tcl->env->vars; var != NULL; var = var->next) {
+      if (var->name == name) {
+        return var->value;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Finds (or creates) a variable in the current frame */
+static tcl_value_t **tcl_var_slot(struct tcl *tcl, const char *name) {
+  struct tcl_env *env = tcl->env;
+  tcl_value_t **slot = NULL;
+  size_t len = strlen(name);
+  /* A name that isn't interned is not used by any variable */
+  struct tcl_name *key = tcl_name_find(tcl, name, len, tcl_hash(name, len));
+  if (env->proc != NULL && key != NULL) {
+    for (int i = 0; i < env->proc->nlocals; i++) {
+      if (env->proc->locals[i] == key) {
+        slot = &tcl->slots[env->base + i];
+        break;
+      }
+    }
+  }
+  if (slot == NULL) {
+    struct tcl_var *var = NULL;
+    if (key != NULL) {
+      for (var = env->vars; var != NULL && var->name != key;
+           var = var->next) {
+      }
+    }
+    if (var == NULL) {
+      var = tcl_env_var(tcl, env,
+                        key != NULL ? tcl_name_dup(key)
+                                    : tcl_intern(tcl, name, len));
+      if (env->parent == NULL && tcl->parent != NULL) {
+        /* Globals of a clone are taken from the snapshot on first use */
+        tcl_value_t *v = tcl_global(tcl->parent, var->name);
+        if (v != NULL) {
+          tcl_free(var->value);
+          var->value = v;
+        }
+      }
+    }
+    slot = &var->value;
+  }
+  if (*slot == NULL) {
+    *slot = &tcl_empty;
+  }
+  return slot;
+}
+
+#ifndef TCL_DISABLE_EVENTS
+/* Returns true if the slot is the global variable that vwait waits for */
+static int tcl_watched(struct tcl *tcl, tcl_value_t **slot) {
+  struct tcl_env *env = tcl->env;
+  while (env->parent != NULL) {
+    env = env->parent;
+  }
+  for (struct tcl_var *var = env->vars; var != NULL; var = var->next) {
+    if (var->name == tcl->watch) {
+      return slot == &var->value;
+    }
+  }
+  return 0;
+}
+#endif
+
+tcl_value_t *tcl_var(struct tcl *tcl, const char *name, tcl_value_t *v) {
+  DBG("var(%s := %.*s)\n", name, tcl_length(v), tcl_string(v));
+  tcl_value_t **slot = tcl_var_slot(tcl, name);
+  if (v != NULL) {
+    tcl_free(*slot);
+    *slot = tcl_keep(v);
+#ifndef TCL_DISABLE_EVENTS
+    if (tcl->watch != NULL) {
+      tcl->changed |= tcl_watched(tcl, slot);
+    }
+#endif
+  }
+  return *slot;
+}
+
+int tcl_result(struct tcl *tcl, int flow, tcl_value_t *result) {
+  DBG("tcl_result %.*s, flow=%d\n", tcl_length(result), tcl_string(result),
+      flow);
+  tcl_free(tcl->result);
+  tcl->result = tcl_keep(result);
+  return flow;
+}
+
+static struct tcl_code *tcl_cached(struct tcl *tcl, const char *s,
+                                    size_t len);
+static int tcl_exec(struct tcl *tcl, struct tcl_code *code);
+
+int tcl_subst(struct tcl *tcl, const char *s, size_t len) {
+  DBG("subst(%.*s)\n", (int)len, s);
+  if (len == 0) {
+    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+  }
+  switch (s[0]) {
+  case '{':
+    if (len <= 1) {
+      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+    }
+    return tcl_result(tcl, FNORMAL, tcl_alloc(s + 1, len - 2));
+  case '$': {
+    int r = tcl_subst(tcl, s + 1, len - 1);
+    if (r != FNORMAL) {
+      return r;
+    }
+    return tcl_result(tcl, FNORMAL,
+                      tcl_dup(*tcl_var_slot(tcl, tcl_string(tcl->result))));
+  }
+  case '[':
+    /* The closing bracket takes the place of the terminator */
+    return tcl_exec(tcl, tcl_cached(tcl, s + 1, len - 1));
+  default:
+    return tcl_result(tcl, FNORMAL, tcl_alloc(s, len));
+  }
+}
+
+static struct tcl_cmd *tcl_lookup(struct tcl *tcl, tcl_value_t *name,
+                                  int n) {
+  const char *s = tcl_string(name);
+  size_t len = name->len;
+  struct tcl_name *key = tcl_name_find(tcl, s, len, tcl_hash(s, len));
+  if (key == NULL) {
+    return NULL;
+  }
+  /* Commands of a clone shadow the commands of its snapshot */
+  for (; tcl != NULL; tcl = tcl->parent) {
+    struct tcl_cmd *cmd = tcl->cmds[key->hash & (tcl->nbuckets - 1)];
+    for (; cmd != NULL; cmd = cmd->next) {
+      if (cmd->name == key && (cmd->arity == 0 || cmd->arity == n)) {
+        return cmd;
+      }
+    }
+  }
+  return NULL;
+}
+
+#if defined(TCL_ENABLE_STATS) || !defined(TCL_DISABLE_EVENTS)
+/* Monotonic time in nanoseconds if available, otherwise wall or processor
+ * time */
+static unsigned long long tcl_now(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#elif defined(TCL_POLL)
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000000ull + tv.tv_usec * 1000ull;
+#elif defined(TIME_UTC)
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+  return clock() * (1000000000ull / CLOCKS_PER_SEC);
+#endif
+}
+#endif
+
+#ifdef TCL_ENABLE_STATS
+/* Returns the statistics of the command in this interpreter, a clone counts
+ * the calls of snapshot commands in its own shadow entries */
+static struct tcl_stats *tcl_stats_of(struct tcl *tcl, struct tcl_cmd *cmd) {
+  if (tcl->parent == NULL) {
+    return &cmd->stats;
+  }
+  struct tcl_cmd *c = tcl->cmds[cmd->name->hash & (tcl->nbuckets - 1)];
+  for (; c != NULL; c = c->next) {
+    if (c == cmd) {
+      return &cmd->stats;
+    }
+  }
+  struct tcl_shadow **head = &tcl->shadows[cmd->name->hash % TCL_SHADOWS];
+  struct tcl_shadow *shadow = *head;
+  for (; shadow != NULL; shadow = shadow->next) {
+    if (shadow->cmd == cmd) {
+      return &shadow->stats;
+    }
+  }
+  shadow = tcl_calloc(tcl->mem, sizeof(struct tcl_shadow));
+  shadow->cmd = cmd;
+  shadow->next = *head;
+  *head = shadow;
+  return &shadow->stats;
+}
+#endif
+
+static struct tcl_cmd *tcl_resolve(struct tcl *tcl, int argc,
+                                   tcl_value_t **argv,
+                                   struct tcl_site *site) {
+  struct tcl_cmd *cmd;
+  if (site != NULL && site->tcl == tcl && site->epoch == tcl->epoch) {
+    return site->cmd;
+  }
+  cmd = tcl_lookup(tcl, argv[0], argc);
+  if (site != NULL && site->named && cmd != NULL) {
+    site->tcl = tcl;
+    site->epoch = tcl->epoch;
+    site->cmd = cmd;
+  }
+  return cmd;
+}
+
+static int tcl_invoke(struct tcl *tcl, struct tcl_cmd *cmd, int argc,
+                      tcl_value_t **argv) {
+  if (argc == 0) {
+    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+  }
+  if (cmd == NULL) {
+    return FERROR;
+  }
+  if (cmd->argv_fn != NULL) {
+    return cmd->argv_fn(tcl, argc, argv, cmd->arg);
+  }
+  /* Commands registered with tcl_register() get the words as a list */
+  tcl_value_t *list = tcl_list_alloc();
+  for (int i = 0; i < argc; i++) {
+    list = tcl_list_append(list, argv[i]);
+  }
+  int r = cmd->fn(tcl, list, cmd->arg);
+  tcl_list_free(list);
+  return r;
+}
+
+static int tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg);
+static int tcl_cmd_flow(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg);
+static int tcl_proc_next(struct tcl *tcl, int flow, int argc,
+                         tcl_value_t **argv, int state);
+static int tcl_if_next(struct tcl *tcl, int flow, int argc,
+                       tcl_value_t **argv, int state);
+static int tcl_while_next(struct tcl *tcl, int flow, int argc,
+                          tcl_value_t **argv, int state);
+static struct tcl_code *tcl_prepare(struct tcl *tcl, tcl_value_t *v);
+
+static struct tcl_frame *tcl_frame_push(struct tcl *tcl,
+                                        struct tcl_frame *parent,
+                                        struct tcl_code *code, int flags) {
+  struct tcl_mark pos = tcl_arena_mark(&tcl->stack);
+  struct tcl_frame *f = tcl_arena_realloc(
+      &tcl->stack, NULL,
+      sizeof(*f) + (code->depth + 1) * sizeof(tcl_value_t *));
+  f->parent = parent;
+  f->pos = pos;
+  f->start = tcl_arena_mark(tcl->arena);
+  f->code = tcl_code_dup(code);
+  f->pc = 0;
+  f->sp = 0;
+  f->flags = flags;
+  f->next = NULL;
+  f->argc = 0;
+  tcl->depth++;
+  return f;
+}
+
+static struct tcl_frame *tcl_frame_pop(struct tcl *tcl, struct tcl_frame *f) {
+  struct tcl_frame *parent = f->parent;
+  int n = f->sp + (f->next != NULL ? f->argc : 0);
+  for (int i = 0; i < n; i++) {
+    tcl_free(f->stack[i]);
+  }
+  tcl_code_free(f->code);
+  tcl_arena_release(tcl->arena, f->start);
+  tcl_arena_release(&tcl->stack, f->pos);
+  tcl->depth--;
+  return parent;
+}
+
+/* Continues the command of the frame after it returned the flow r. Returns
+ * FCALL if the command evaluates another script, otherwise the command is
+ * complete and its words are freed. */
+static int tcl_frame_next(struct tcl *tcl, struct tcl_frame *f, int r) {
+  while (r == FCALL) {
+    f->next = tcl->call.next;
+    f->state = tcl->call.state;
+    if (tcl->depth < TCL_MAX_DEPTH) {
+      return FCALL;
+    }
+    r = f->next(tcl, tcl_result(tcl, FERROR, tcl_alloc("", 0)), f->argc,
+                f->stack + f->sp, f->state);
+  }
+  for (int i = 0; i < f->argc; i++) {
+    tcl_free(f->stack[f->sp + i]);
+  }
+  f->next = NULL;
+  f->argc = 0;
+  /* Temporary values of the command are no longer used */
+  tcl_arena_release(tcl->arena, f->start);
+#ifdef TCL_ENABLE_STATS
+  if (f->stats != NULL) {
+    unsigned long long t = tcl_now() - f->time;
+    f->stats->calls++;
+    f->stats->time += t;
+    f->stats->max = (t > f->stats->max ? t : f->stats->max);
+    f->stats->allocs += tcl_nallocs - f->allocs;
+  }
+#endif
+  return r;
+}
+
+/* "return [cmd ...]" is a tail call if return is the builtin command and
+ * the frame is the body of a procedure, or a branch of if and while in it */
+static int tcl_frame_tail(struct tcl *tcl, struct tcl_frame *f,
+                          tcl_value_t **argv, struct tcl_site *site) {
+  for (; f->parent != NULL && !(f->flags & TCL_FRAME_SUB); f = f->parent) {
+    tcl_next_fn_t next = f->parent->next;
+    if (next == tcl_proc_next) {
+      struct tcl_cmd *cmd = tcl_resolve(tcl, 2, argv, site);
+      return cmd != NULL && cmd->argv_fn == tcl_cmd_flow;
+    }
+    if (next != tcl_if_next && next != tcl_while_next) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/* Replaces the frames of the returning procedure with the body of the called
+ * one, the caller keeps waiting for the result */
+static struct tcl_frame *tcl_tail_call(struct tcl *tcl, struct tcl_frame *f,
+                                       struct tcl_proc *proc,
+                                       tcl_value_t **argv) {
+  tcl->env = tcl_env_free(tcl, tcl->env);
+  tcl->env = tcl_env_alloc(tcl, proc);
+  for (int i = 0; i < proc->nparams; i++) {
+    tcl->slots[tcl->env->base + i] = tcl_keep(argv[i + 1]);
+  }
+  tcl_free(argv[0]);
+  while (f->parent->next != tcl_proc_next) {
+    f = tcl_frame_pop(tcl, f);
+  }
+  f = tcl_frame_pop(tcl, f);
+  return tcl_frame_push(tcl, f, tcl_prepare(tcl, proc->body), 0);
+}
+
+static int tcl_yield_next(struct tcl *tcl, int flow, int argc,
+                          tcl_value_t **argv, int state) {
+  (void)tcl;
+  (void)argc;
+  (void)argv;
+  (void)state;
+  return flow;
+}
+
+/* Runs the frame and its children until the frame ends or a coroutine
+ * yields. A resumed frame continues the command it was waiting for. */
+static int tcl_run(struct tcl *tcl, struct tcl_frame *f, int resume) {
+  struct tcl_code *code = f->code;
+  tcl_value_t **stack = f->stack;
+  tcl_value_t *last = NULL;
+  int pc = f->pc;
+  int sp = f->sp;
+  int r = FNORMAL;
+  for (;;) {
+    if (resume) {
+      resume = 0;
+      r = f->next(tcl, r, f->argc, stack + sp, f->state);
+      r = tcl_frame_next(tcl, f, r);
+      if (r == FCALL) {
+        f = tcl_frame_push(tcl, f, tcl->call.code, 0);
+        code = f->code;
+        stack = f->stack;
+        pc = sp = 0;
+        r = FNORMAL;
+      }
+      continue;
+    }
+    if (r == FNORMAL && pc < code->nops) {
+      int op = code->ops[pc];
+      int arg = code->ops[pc + 1];
+      pc += 2;
+      switch (op) {
+      case OP_PUSH:
+        last = stack[sp++] = tcl_dup(code->lits[arg]);
+        break;
+      case OP_LOAD: {
+        struct tcl_vsite *vs = &code->vsites[arg];
+        struct tcl_env *env = tcl->env;
+        tcl_value_t **slot;
+        if (env->proc != NULL && vs->proc == env->proc) {
+          slot = &tcl->slots[env->base + vs->slot];
+          if (*slot == NULL) {
+            *slot = &tcl_empty;
+          }
+        } else {
+          slot = tcl_var_slot(tcl, tcl_string(code->lits[vs->lit]));
+          if (env->proc != NULL && code->refs > 0 &&
+              slot >= tcl->slots + env->base &&
+              slot < tcl->slots + env->base + env->proc->nlocals) {
+            vs->proc = env->proc;
+            vs->slot = slot - (tcl->slots + env->base);
+          }
+        }
+        last = stack[sp++] = tcl_dup(*slot);
+        break;
+      }
+      case OP_VAR: {
+        tcl_value_t *name = stack[sp - 1];
+        last = stack[sp - 1] = tcl_dup(*tcl_var_slot(tcl, tcl_string(name)));
+        tcl_free(name);
+        break;
+      }
+      case OP_SUB:
+      case OP_TAIL: {
+        int flags = TCL_FRAME_SUB;
+        last = NULL;
+        if (tcl->depth >= TCL_MAX_DEPTH) {
+          r = tcl_result(tcl, FERROR, tcl_alloc("", 0));
+          break;
+        }
+        if (op == OP_TAIL &&
+            tcl_frame_tail(tcl, f, &stack[sp - 1],
+                           code->refs > 0 ? &code->sites[code->ops[pc + 1]]
+                                          : NULL)) {
+          flags |= TCL_FRAME_TAIL;
+        }
+        f->pc = pc;
+        f->sp = sp;
+        f = tcl_frame_push(tcl, f, code->subs[arg], flags);
+        code = f->code;
+        stack = f->stack;
+        pc = sp = 0;
+        break;
+      }
+      case OP_CAT:
+        if (last != NULL) {
+          /* Substitution leaves the last word part in the result */
+          tcl_result(tcl, FNORMAL, tcl_dup(last));
+          last = NULL;
+        }
+        sp = sp - arg + 1;
+        for (int i = 0; i < arg - 1; i++) {
+          stack[sp - 1] = tcl_append(stack[sp - 1], stack[sp + i]);
+        }
+        break;
+      case OP_INVOKE: {
+        struct tcl_site *site = &code->sites[arg];
+        struct tcl_cmd *cmd = NULL;
+        int argc = site->words;
+        if (last != NULL) {
+          tcl_result(tcl, FNORMAL, tcl_dup(last));
+          last = NULL;
+        }
+        sp = sp - argc;
+        if (argc > 0) {
+          cmd = tcl_resolve(tcl, argc, stack + sp,
+                            code->refs > 0 ? site : NULL);
+        }
+        if ((f->flags & TCL_FRAME_TAIL) && pc == code->nops &&
+            cmd != NULL && cmd->argv_fn == tcl_user_proc &&
+            argc == ((struct tcl_proc *)cmd->arg)->nparams + 1) {
+          f->sp = sp;
+          f = tcl_tail_call(tcl, f, cmd->arg, stack + sp);
+          code = f->code;
+          stack = f->stack;
+          pc = sp = 0;
+          break;
+        }
+        f->sp = sp;
+        f->argc = argc;
+#ifdef TCL_ENABLE_STATS
+        f->stats = (cmd != NULL ? tcl_stats_of(tcl, cmd) : NULL);
+        f->time = tcl_now();
+        f->allocs = tcl_nallocs;
+#endif
+        r = tcl_invoke(tcl, cmd, argc, stack + sp);
+        if (r == FYIELD && tcl->coro != NULL) {
+          /* The coroutine is suspended in this command */
+          f->pc = pc;
+          f->next = tcl_yield_next;
+          tcl->coro->top = f;
+          return r;
+        }
+        r = tcl_frame_next(tcl, f, r);
+        if (r == FCALL) {
+          f->pc = pc;
+          f = tcl_frame_push(tcl, f, tcl->call.code, 0);
+          code = f->code;
+          stack = f->stack;
+          pc = sp = 0;
+          r = FNORMAL;
+        }
+        break;
+      }
+      case OP_ERROR:
+        DBG("eval: FERROR, lexer error\n");
+        r = tcl_result(tcl, FERROR, tcl_alloc("", 0));
+        break;
+      }
+      continue;
+    }
+    /* The frame ends, its parent continues */
+    int flags = f->flags;
+    f->sp = sp;
+    f = tcl_frame_pop(tcl, f);
+    if (f == NULL) {
+      return r;
+    }
+    code = f->code;
+    stack = f->stack;
+    pc = f->pc;
+    sp = f->sp;
+    last = NULL;
+    if (!(flags & TCL_FRAME_SUB)) {
+      resume = 1;
+    } else if (r != FERROR) {
+      stack[sp++] = tcl_dup(tcl->result);
+      r = FNORMAL;
+    }
+  }
+}
+
+static int tcl_exec(struct tcl *tcl, struct tcl_code *code) {
+  struct tcl_allocator *mem = tcl_mem;
+  if (tcl->clones > 0) {
+    /* Clones read the snapshot without locks */
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  /* Scripts evaluated by C code can't yield, they are on the C stack */
+  struct tcl_coro *coro = tcl->coro;
+  tcl_mem = (tcl->arena != NULL ? &tcl->arena->mem : tcl->mem);
+  tcl->coro = NULL;
+  int r = tcl_run(tcl, tcl_frame_push(tcl, NULL, code, 0), 0);
+  tcl->coro = coro;
+  tcl_mem = mem;
+  return r;
+}
+
+/* Returns the compiled script, the terminator at s[len - 1] is not read, so
+ * that scripts in the middle of a string are evaluated without a copy */
+static struct tcl_code *tcl_cached(struct tcl *tcl, const char *s,
+                                    size_t len) {
+  unsigned int h = tcl_hash(s, len > 0 ? len - 1 : 0);
+  struct tcl_code **slot = &tcl->cache[h % TCL_CODE_CACHE];
+  struct tcl_code *code = *slot;
+  if (code == NULL || !tcl_code_is(code, s, len, h)) {
+    /* A running evicted script keeps its own reference */
+    tcl_code_free(code);
+    code = NULL;
+#ifdef TCL_POOL
+    if (tcl->pool != NULL) {
+      code = tcl_pool_code(tcl->pool, s, len, h);
+    }
+#endif
+    if (code == NULL) {
+      code = tcl_compile_source(tcl->mem, s, len, h);
+    }
+    *slot = code;
+  }
+  return code;
+}
+
+int tcl_eval(struct tcl *tcl, const char *s, size_t len) {
+  DBG("eval(%.*s)->\n", (int)len, s);
+  return tcl_exec(tcl, tcl_cached(tcl, s, len));
+}
+
+static void tcl_coro_swap(struct tcl *tcl, struct tcl_coro *co) {
+  struct tcl_coro saved = *co;
+  co->stack = tcl->stack;
+  co->arena = tcl->arena;
+  co->env = tcl->env;
+  co->slots = tcl->slots;
+  co->nslots = tcl->nslots;
+  co->capslots = tcl->capslots;
+  co->depth = tcl->depth;
+  tcl->stack = saved.stack;
+  tcl->arena = saved.arena;
+  tcl->env = saved.env;
+  tcl->slots = saved.slots;
+  tcl->nslots = saved.nslots;
+  tcl->capslots = saved.capslots;
+  tcl->depth = saved.depth;
+}
+
+/* Starts the code, or resumes the coroutine if code is NULL */
+static int tcl_coro_run(struct tcl *tcl, struct tcl_coro *co,
+                        struct tcl_code *code) {
+  struct tcl_allocator *mem = tcl_mem;
+  struct tcl_coro *outer = tcl->coro;
+  if (tcl->clones > 0) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  tcl_coro_swap(tcl, co);
+  tcl->coro = co;
+  tcl_mem = tcl->mem;
+  if (code != NULL) {
+    co->top = tcl_frame_push(tcl, NULL, code, 0);
+  }
+  int r = tcl_run(tcl, co->top, code == NULL);
+  if (r != FYIELD) {
+    co->top = NULL;
+  }
+  tcl->coro = outer;
+  tcl_mem = mem;
+  tcl_coro_swap(tcl, co);
+  return r;
+}
+
+/* Runs the script as a coroutine in the global scope. Returns FYIELD with
+ * the yielded value in the result, or the flow of the finished script. */
+int tcl_coro_start(struct tcl *tcl, struct tcl_coro *co, const char *s,
+                   size_t len) {
+  memset(co, 0, sizeof(*co));
+  co->stack.heap = tcl->mem;
+  co->stack.chunk = 1024;
+  co->env = tcl->env;
+  while (co->env->parent != NULL) {
+    co->env = co->env->parent;
+  }
+  return tcl_coro_run(tcl, co, tcl_cached(tcl, s, len));
+}
+
+/* Continues a suspended coroutine, yield returns the value (may be NULL) */
+int tcl_coro_resume(struct tcl *tcl, struct tcl_coro *co, tcl_value_t *value) {
+  if (co->top == NULL) {
+    tcl_free(value);
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  tcl_result(tcl, FNORMAL, value != NULL ? value : tcl_alloc("", 0));
+  return tcl_coro_run(tcl, co, NULL);
+}
+
+/* Releases the coroutine, finished or not */
+void tcl_coro_free(struct tcl *tcl, struct tcl_coro *co) {
+  if (co->top != NULL) {
+    tcl_coro_swap(tcl, co);
+    for (struct tcl_frame *f = co->top; f != NULL;) {
+      f = tcl_frame_pop(tcl, f);
+    }
+    while (tcl->env->parent != NULL) {
+      tcl->env = tcl_env_free(tcl, tcl->env);
+    }
+    tcl_coro_swap(tcl, co);
+    co->top = NULL;
+  }
+  tcl_arena_free(&co->stack);
+  tcl_mfree(tcl->mem, co->slots);
+  co->slots = NULL;
+}
+
+/* Compiles a value as a script, keeping the compiled form in the value */
+static struct tcl_code *tcl_prepare(struct tcl *tcl, tcl_value_t *v) {
+  if (v->type != TCL_CODE) {
+    struct tcl_code *code = tcl_cached(tcl, tcl_bytes(v), tcl_length(v) + 1);
+    if (v->refs < 0) {
+      /* Frozen values can't keep it, but the code cache does */
+      return code;
+    }
+    tcl_code_dup(code);
+    tcl_free_rep(v);
+    v->type = TCL_CODE;
+    v->rep.code = code;
+  }
+  return v->rep.code;
+}
+
+/* Makes the running command evaluate the compiled script */
+static int tcl_then_code(struct tcl *tcl, struct tcl_code *code,
+                         tcl_next_fn_t next, int state) {
+  tcl->call.code = code;
+  tcl->call.next = next;
+  tcl->call.state = state;
+  return FCALL;
+}
+
+/* Makes the running command evaluate the script, see struct tcl_frame */
+static int tcl_then(struct tcl *tcl, tcl_value_t *script, tcl_next_fn_t next,
+                    int state) {
+  return tcl_then_code(tcl, tcl_prepare(tcl, script), next, state);
+}
+
+#ifndef TCL_DISABLE_EVENTS
+/* Event loop. Timers ("after" scripts and events posted by the host) are
+ * kept in a binary min-heap ordered by due time, then by id. The heap index of
+ * each event is kept in an open addressing table with twice as many entries
+ * as the heap can hold, so adding, running and cancelling an event takes
+ * O(log n). Events run in the global scope, their errors are ignored. */
+static unsigned long long tcl_clock_ms(void) { return tcl_now() / 1000000; }
+
+static int tcl_event_before(struct tcl_event *a, struct tcl_event *b) {
+  return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
+
+/* Returns the table entry of the event id, or the empty entry where it would
+ * be added. Ids are sequential, so they are hashed by their lowest bits. */
+static struct tcl_event_pos *tcl_event_pos(struct tcl *tcl, unsigned long id) {
+  size_t mask = tcl->capevents * 2 - 1;
+  size_t h = id & mask;
+  while (tcl->eventpos[h].id != id && tcl->eventpos[h].id != 0) {
+    h = (h + 1) & mask;
+  }
+  return &tcl->eventpos[h];
+}
+
+/* Removes the entry of the event id, moving the following entries of the
+ * cluster back so that no lookup stops early */
+static void tcl_event_unpos(struct tcl *tcl, unsigned long id) {
+  size_t mask = tcl->capevents * 2 - 1;
+  struct tcl_event_pos *pos = tcl->eventpos;
+  size_t h = tcl_event_pos(tcl, id) - pos;
+  for (size_t j = (h + 1) & mask; pos[j].id != 0; j = (j + 1) & mask) {
+    if (((j - (pos[j].id & mask)) & mask) >= ((j - h) & mask)) {
+      pos[h] = pos[j];
+      h = j;
+    }
+  }
+  pos[h].id = 0;
+}
+
+static void tcl_event_move(struct tcl *tcl, int i, struct tcl_event *e) {
+  tcl->events[i] = *e;
+  tcl_event_pos(tcl, e->id)->i = i;
+}
+
+/* Moves the event at index i up or down to its place in the heap */
+static void tcl_event_fix(struct tcl *tcl, int i) {
+  struct tcl_event *heap = tcl->events;
+  struct tcl_event e = heap[i];
+  int n = tcl->nevents;
+  while (i > 0 && tcl_event_before(&e, &heap[(i - 1) / 2])) {
+    tcl_event_move(tcl, i, &heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c + 1 < n && tcl_event_before(&heap[c + 1], &heap[c])) {
+      c++;
+    }
+    if (c >= n || !tcl_event_before(&heap[c], &e)) {
+      break;
+    }
+    tcl_event_move(tcl, i, &heap[c]);
+    i = c;
+  }
+  tcl_event_move(tcl, i, &e);
+}
+
+static unsigned long tcl_event_add(struct tcl *tcl, long ms,
+                                   tcl_value_t *script, tcl_event_fn_t fn,
+                                   void *arg) {
+  if (tcl->nevents == tcl->capevents) {
+    tcl->capevents = (tcl->capevents == 0 ? 16 : tcl->capevents * 2);
+    tcl->events = tcl_realloc(tcl->mem, tcl->events,
+                              tcl->capevents * sizeof(struct tcl_event));
+    tcl_mfree(tcl->mem, tcl->eventpos);
+    tcl->eventpos = tcl_calloc(tcl->mem, tcl->capevents * 2 *
+                                             sizeof(struct tcl_event_pos));
+    for (int i = 0; i < tcl->nevents; i++) {
+      struct tcl_event_pos *pos = tcl_event_pos(tcl, tcl->events[i].id);
+      pos->id = tcl->events[i].id;
+      pos->i = i;
+    }
+  }
+  struct tcl_event *e = &tcl->events[tcl->nevents];
+  e->when = tcl_clock_ms() + (ms > 0 ? ms : 0);
+  e->id = ++tcl->nextevent;
+  e->script = script;
+  e->fn = fn;
+  e->arg = arg;
+  tcl_event_pos(tcl, e->id)->id = e->id;
+  tcl->nevents++;
+  tcl_event_fix(tcl, tcl->nevents - 1);
+  return tcl->nextevent;
+}
+
+static void tcl_event_remove(struct tcl *tcl, int i) {
+  tcl_free(tcl->events[i].script);
+  tcl_event_unpos(tcl, tcl->events[i].id);
+  if (i < --tcl->nevents) {
+    tcl_event_move(tcl, i, &tcl->events[tcl->nevents]);
+    tcl_event_fix(tcl, i);
+  }
+}
+
+/* Calls fn(tcl, arg) from the event loop after ms milliseconds, returns the
+ * event id */
+unsigned long tcl_event_post(struct tcl *tcl, long ms, tcl_event_fn_t fn,
+                             void *arg) {
+  return tcl_event_add(tcl, ms, NULL, fn, arg);
+}
+
+/* Removes a pending event, returns 0 if it's not pending */
+int tcl_event_cancel(struct tcl *tcl, unsigned long id) {
+  if (tcl->nevents == 0 || id == 0 || tcl_event_pos(tcl, id)->id == 0) {
+    return 0;
+  }
+  tcl_event_remove(tcl, tcl_event_pos(tcl, id)->i);
+  return 1;
+}
+
+/* Milliseconds until the next event is due, 0 if one is due now and -1 if
+ * there are no events: a timeout for poll() or epoll_wait() */
+long tcl_event_timeout(struct tcl *tcl) {
+  if (tcl->nevents == 0) {
+    return -1;
+  }
+  unsigned long long now = tcl_clock_ms();
+  return tcl->events[0].when <= now ? 0 : (long)(tcl->events[0].when - now);
+}
+
+/* Runs the events that are due, but not the ones they add. Returns the
+ * number of events that ran. */
+int tcl_event_update(struct tcl *tcl) {
+  unsigned long long now = tcl_clock_ms();
+  unsigned long last = tcl->nextevent;
+  int n = 0;
+  while (tcl->nevents > 0 && tcl->events[0].when <= now &&
+         tcl->events[0].id <= last) {
+    struct tcl_event e = tcl->events[0];
+    tcl->events[0].script = NULL;
+    tcl_event_remove(tcl, 0);
+    if (e.fn != NULL) {
+      e.fn(tcl, e.arg);
+    } else {
+      struct tcl_env *env = tcl->env;
+      while (tcl->env->parent != NULL) {
+        tcl->env = tcl->env->parent;
+      }
+      tcl_exec(tcl, tcl_prepare(tcl, e.script));
+      tcl->env = env;
+      tcl_free(e.script);
+    }
+    n++;
+  }
+  return n;
+}
+
+/* Blocking in the event loop goes through the waiter, so the host can run its
+ * own poll or epoll loop there and post events. By default the loop sleeps
+ * until the next event. */
+void tcl_event_waiter(struct tcl *tcl, tcl_wait_fn_t fn, void *arg) {
+  tcl->waiter = fn;
+  tcl->waiterarg = arg;
+}
+
+static void tcl_event_wait(struct tcl *tcl, long ms) {
+  if (tcl->waiter != NULL) {
+    tcl->waiter(tcl, ms, tcl->waiterarg);
+  } else if (ms > 0) {
+#ifdef TCL_POLL
+    poll(NULL, 0, (int)ms);
+#endif
+  }
+}
+#endif
+
+/* --------------------------------- */
+/* --------------------------------- */
+/* --------------------------------- */
+/* --------------------------------- */
+/* --------------------------------- */
+static void tcl_register_cmd(struct tcl *tcl, const char *name,
+                             tcl_cmd_fn_t fn, tcl_argv_fn_t argv_fn, int arity,
+                             void *arg) {
+  struct tcl_cmd *cmd = tcl_malloc(tcl->mem, sizeof(struct tcl_cmd));
+  cmd->name = tcl_intern(tcl, name, strlen(name));
+  cmd->fn = fn;
+  cmd->argv_fn = argv_fn;
+  cmd->arg = arg;
+#ifdef TCL_ENABLE_STATS
+  memset(&cmd->stats, 0, sizeof(cmd->stats));
+#endif
+  cmd->arity = arity;
+  if (tcl->ncmds >= tcl->nbuckets) {
+    /* Grow the table keeping the order of commands within each chain */
+    int n = tcl->nbuckets * 2;
+    struct tcl_cmd **cmds = tcl_calloc(tcl->mem, n * sizeof(struct tcl_cmd *));
+    for (int i = 0; i < tcl->nbuckets; i++) {
+      while (tcl->cmds[i] != NULL) {
+        struct tcl_cmd *c = tcl->cmds[i];
+        struct tcl_cmd **tail = &cmds[c->name->hash & (n - 1)];
+        tcl->cmds[i] = c->next;
+        while (*tail != NULL) {
+          tail = &(*tail)->next;
+        }
+        c->next = NULL;
+        *tail = c;
+      }
+    }
+    tcl_mfree(tcl->mem, tcl->cmds);
+    tcl->cmds = cmds;
+    tcl->nbuckets = n;
+  }
+  struct tcl_cmd **head = &tcl->cmds[cmd->name->hash & (tcl->nbuckets - 1)];
+  if (tcl->parent != NULL) {
+    /* The command may shadow a command of the snapshot */
+    tcl->epoch++;
+  }
+  for (struct tcl_cmd *c = *head; c != NULL; c = c->next) {
+    if (c->name == cmd->name) {
+      /* Redefined command, cached call sites must resolve it again */
+      tcl->epoch++;
+      break;
+    }
+  }
+  cmd->next = *head;
+  *head = cmd;
+  tcl->ncmds++;
+}
+
+void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity,
+                  void *arg) {
+  tcl_register_cmd(tcl, name, fn, NULL, arity, arg);
+}
+
+void tcl_register_argv(struct tcl *tcl, const char *name, tcl_argv_fn_t fn,
+                       int arity, void *arg) {
+  tcl_register_cmd(tcl, name, NULL, fn, arity, arg);
+}
+
+#ifdef TCL_ENABLE_STATS
+typedef void (*tcl_stats_fn_t)(const char *name, const struct tcl_stats *stats,
+                               void *arg);
+
+/* Reports the statistics of every command that has been called */
+void tcl_stats(struct tcl *tcl, tcl_stats_fn_t fn, void *arg) {
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+      if (cmd->stats.calls > 0) {
+        fn(cmd->name->s, &cmd->stats, arg);
+      }
+    }
+  }
+  for (int i = 0; i < TCL_SHADOWS; i++) {
+    struct tcl_shadow *shadow = tcl->shadows[i];
+    for (; shadow != NULL; shadow = shadow->next) {
+      fn(shadow->cmd->name->s, &shadow->stats, arg);
+    }
+  }
+}
+
+struct tcl_stats_list {
+  const char *name;
+  tcl_value_t *list;
+};
+
+static void tcl_stats_item(const char *name, const struct tcl_stats *stats,
+                           void *arg) {
+  struct tcl_stats_list *out = (struct tcl_stats_list *)arg;
+  long long fields[] = {(long long)stats->calls, (long long)stats->time,
+                        (long long)stats->max, (long long)stats->allocs};
+  if (out->name != NULL && strcmp(out->name, name) != 0) {
+    return;
+  }
+  tcl_value_t *item = tcl_alloc(name, strlen(name));
+  tcl_value_t *list = tcl_list_append(tcl_list_alloc(), item);
+  tcl_free(item);
+  for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    item = tcl_alloc_wide(fields[i]);
+    list = tcl_list_append(list, item);
+    tcl_free(item);
+  }
+  out->list = tcl_list_append(out->list, list);
+  tcl_free(list);
+}
+
+/* "stats ?name?" returns {name calls time max allocs} for each command */
+static int tcl_cmd_stats(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  struct tcl_stats_list out = {NULL, tcl_list_alloc()};
+  if (argc > 1) {
+    out.name = tcl_string(argv[1]);
+  }
+  tcl_stats(tcl, tcl_stats_item, &out);
+  return tcl_result(tcl, FNORMAL, out.list);
+}
+#endif
+
+static int tcl_cmd_set(struct tcl *tcl, int argc, tcl_value_t **argv,
+                       void *arg) {
+  (void)arg;
+  tcl_value_t *var = (argc > 1 ? argv[1] : NULL);
+  tcl_value_t *val = (argc > 2 ? tcl_dup(argv[2]) : NULL);
+  return tcl_result(tcl, FNORMAL,
+                    tcl_dup(tcl_var(tcl, tcl_string(var), val)));
+}
+
+/* Dereferences the result of the command as many times as there were
+ * dollar signs before it */
+static int tcl_subst_next(struct tcl *tcl, int flow, int argc,
+                          tcl_value_t **argv, int state) {
+  (void)argc;
+  (void)argv;
+  for (; flow == FNORMAL && state > 0; state--) {
+    tcl_result(tcl, FNORMAL,
+               tcl_dup(*tcl_var_slot(tcl, tcl_string(tcl->result))));
+  }
+  return flow;
+}
+
+static int tcl_cmd_subst(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  (void)argc;
+  const char *s = tcl_bytes(argv[1]);
+  size_t len = argv[1]->len;
+  size_t n = 0;
+  if (len > 1 && s[0] == '{') {
+    /* Braced words are slices of the argument */
+    return tcl_result(tcl, FNORMAL,
+                      tcl_slice(tcl_mem, argv[1], s + 1, len - 2));
+  }
+  for (; n < len && s[n] == '$'; n++) {
+  }
+  if (n < len && s[n] == '[') {
+    /* The command runs in a frame instead of recursing on the C stack */
+    return tcl_then_code(tcl, tcl_cached(tcl, s + n + 1, len - n - 1),
+                         tcl_subst_next, (int)n);
+  }
+  return tcl_subst(tcl, s, len);
+}
+
+#ifndef TCL_DISABLE_PUTS
+static int tcl_cmd_puts(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  (void)argc;
+  puts(tcl_string(argv[1]));
+  putchar('\n');
+  return tcl_result(tcl, FNORMAL, tcl_dup(argv[1]));
+}
+#endif
+
+static void tcl_proc_local(struct tcl *tcl, struct tcl_proc *proc,
+                           tcl_value_t *name) {
+  struct tcl_name *local =
+      tcl_intern(tcl, tcl_string(name), (size_t)tcl_length(name));
+  for (int i = 0; i < proc->nlocals; i++) {
+    if (proc->locals[i] == local) {
+      tcl_name_free(tcl, local);
+      return;
+    }
+  }
+  proc->locals = tcl_realloc(tcl->mem, proc->locals,
+                             (proc->nlocals + 1) * sizeof(struct tcl_name *));
+  proc->locals[proc->nlocals++] = local;
+}
+
+/* Finds literal variable names in "$name" and "set name ..." */
+static void tcl_proc_scan(struct tcl *tcl, struct tcl_proc *proc,
+                          struct tcl_code *code) {
+  int *lits = tcl_malloc(tcl->mem, (code->depth + 1) * sizeof(int));
+  int sp = 0;
+  for (int pc = 0; pc < code->nops; pc += 2) {
+    int arg = code->ops[pc + 1];
+    switch (code->ops[pc]) {
+    case OP_PUSH:
+      lits[sp++] = arg;
+      break;
+    case OP_LOAD:
+      tcl_proc_local(tcl, proc, code->lits[code->vsites[arg].lit]);
+      lits[sp++] = -1;
+      break;
+    case OP_VAR:
+      if (lits[sp - 1] >= 0) {
+        tcl_proc_local(tcl, proc, code->lits[lits[sp - 1]]);
+      }
+      lits[sp - 1] = -1;
+      break;
+    case OP_SUB:
+    case OP_TAIL:
+      tcl_proc_scan(tcl, proc, code->subs[arg]);
+      lits[sp++] = -1;
+      break;
+    case OP_CAT:
+      sp = sp - arg + 1;
+      lits[sp - 1] = -1;
+      break;
+    case OP_INVOKE: {
+      int words = code->sites[arg].words;
+      sp = sp - words;
+      if (words >= 2 && lits[sp] >= 0 && lits[sp + 1] >= 0 &&
+          strcmp(tcl_string(code->lits[lits[sp]]), "set") == 0) {
+        tcl_proc_local(tcl, proc, code->lits[lits[sp + 1]]);
+      }
+      break;
+    }
+    }
+  }
+  tcl_mfree(tcl->mem, lits);
+}
+
+static struct tcl_proc *tcl_proc_alloc(struct tcl *tcl, tcl_value_t *params,
+                                       tcl_value_t *body) {
+  struct tcl_proc *proc = tcl_calloc(tcl->mem, sizeof(struct tcl_proc));
+  for (int i = 0; i < tcl_list_length(params); i++) {
+    tcl_value_t *param = tcl_list_at(params, i);
+    tcl_proc_local(tcl, proc, param);
+    tcl_free(param);
+  }
+  proc->nparams = proc->nlocals;
+  proc->body = tcl_keep(tcl_dup(body));
+  tcl_proc_scan(tcl, proc, tcl_prepare(tcl, proc->body));
+  return proc;
+}
+
+static void tcl_proc_free(struct tcl *tcl, struct tcl_proc *proc) {
+  for (int i = 0; i < proc->nlocals; i++) {
+    tcl_name_free(tcl, proc->locals[i]);
+  }
+  tcl_mfree(tcl->mem, proc->locals);
+  tcl_free(proc->body);
+  tcl_mfree(tcl->mem, proc);
+}
+
+static int tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  struct tcl_proc *proc = (struct tcl_proc *)arg;
+  if (argc != proc->nparams + 1) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  tcl->env = tcl_env_alloc(tcl, proc);
+  for (int i = 0; i < proc->nparams; i++) {
+    tcl->slots[tcl->env->base + i] = tcl_dup(argv[i + 1]);
+  }
+  return tcl_then(tcl, proc->body, tcl_proc_next, 0);
+}
+
+/* Errors leave the procedure, other flows of the body end it */
+static int tcl_proc_next(struct tcl *tcl, int flow, int argc,
+                         tcl_value_t **argv, int state) {
+  (void)argc;
+  (void)argv;
+  (void)state;
+  tcl->env = tcl_env_free(tcl, tcl->env);
+  return flow == FERROR ? FERROR : FNORMAL;
+}
+
+static int tcl_cmd_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  (void)argc;
+  tcl_register_argv(tcl, tcl_string(argv[1]), tcl_user_proc, 0,
+                    tcl_proc_alloc(tcl, argv[2], argv[3]));
+  return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+}
+
+/* State is the index of the evaluated condition, or 0 for a branch */
+static int tcl_if_next(struct tcl *tcl, int flow, int argc,
+                       tcl_value_t **argv, int i) {
+  if (i == 0 || flow != FNORMAL) {
+    return flow;
+  }
+  if (tcl_int(tcl->result)) {
+    if (i + 1 >= argc) {
+      return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+    }
+    return tcl_then(tcl, argv[i + 1], tcl_if_next, 0);
+  }
+  if (i + 2 < argc) {
+    return tcl_then(tcl, argv[i + 2], tcl_if_next, i + 2);
+  }
+  return FNORMAL;
+}
+
+static int tcl_cmd_if(struct tcl *tcl, int argc, tcl_value_t **argv,
+                      void *arg) {
+  (void)arg;
+  if (argc < 2) {
+    return FNORMAL;
+  }
+  return tcl_then(tcl, argv[1], tcl_if_next, 1);
+}
+
+static int tcl_cmd_yield(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  if (tcl->coro == NULL) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  return tcl_result(tcl, FYIELD,
+                    argc > 1 ? tcl_dup(argv[1]) : tcl_alloc("", 0));
+}
+
+static int tcl_cmd_flow(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  int r = FERROR;
+  const char *flow = tcl_string(argv[0]);
+  if (strcmp(flow, "break") == 0) {
+    r = FBREAK;
+  } else if (strcmp(flow, "continue") == 0) {
     r = FAGAIN;
   } else if (strcmp(flow, "return") == 0) {
-    r = tcl_result(tcl, FRETURN, tcl_list_at(args, 1));
+    r = tcl_result(tcl, FRETURN, argc > 1 ? tcl_dup(argv[1]) : NULL);
+  }
+  return r;
+}
+
+/* State is 0 after the condition and 1 after the body */
+static int tcl_while_next(struct tcl *tcl, int flow, int argc,
+                          tcl_value_t **argv, int body) {
+  (void)argc;
+  if (!body) {
+    if (flow != FNORMAL) {
+      return flow;
+    }
+    if (!tcl_int(tcl->result)) {
+      return FNORMAL;
+    }
+    return tcl_then(tcl, argv[2], tcl_while_next, 1);
+  }
+  switch (flow) {
+  case FBREAK:
+    return FNORMAL;
+  case FRETURN:
+  case FERROR:
+    return flow;
+  }
+  return tcl_then(tcl, argv[1], tcl_while_next, 0);
+}
+
+static int tcl_cmd_while(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  (void)argc;
+  return tcl_then(tcl, argv[1], tcl_while_next, 0);
+}
+
+#ifndef TCL_DISABLE_EVENTS
+/* "after ms" sleeps, "after ms script" schedules the script and returns its
+ * id, "after cancel id" removes it */
+static int tcl_cmd_after(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  char id[32];
+  if (argc == 3 && strcmp(tcl_string(argv[1]), "cancel") == 0) {
+    const char *s = tcl_string(argv[2]);
+    if (strncmp(s, "after#", 6) != 0 ||
+        !tcl_event_cancel(tcl, strtoul(s + 6, NULL, 10))) {
+      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+    }
+    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+  }
+  if (argc == 2) {
+    unsigned long long end = tcl_clock_ms() + tcl_wide(argv[1]);
+    for (unsigned long long now = tcl_clock_ms(); now < end;
+         now = tcl_clock_ms()) {
+      tcl_event_wait(tcl, (long)(end - now));
+    }
+    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+  }
+  if (argc != 3) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  snprintf(id, sizeof(id), "after#%lu",
+           tcl_event_add(tcl, (long)tcl_wide(argv[1]),
+                         tcl_keep(tcl_dup(argv[2])), NULL, NULL));
+  return tcl_result(tcl, FNORMAL, tcl_alloc(id, strlen(id)));
+}
+
+static int tcl_cmd_update(struct tcl *tcl, int argc, tcl_value_t **argv,
+                          void *arg) {
+  (void)argc;
+  (void)argv;
+  (void)arg;
+  tcl_event_update(tcl);
+  return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+}
+
+/* Runs the event loop until the global variable is set, fails if there is
+ * nothing left that could set it. The variable is watched by name, so it's
+ * not created until it's set. */
+static int tcl_cmd_vwait(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)argc;
+  (void)arg;
+  struct tcl_name *watch = tcl->watch;
+  int r = FNORMAL;
+  tcl->watch = tcl_intern(tcl, tcl_string(argv[1]), tcl_length(argv[1]));
+  tcl->changed = 0;
+  while (!tcl->changed) {
+    if (tcl_event_update(tcl) > 0) {
+      continue;
+    }
+    long ms = tcl_event_timeout(tcl);
+    if (ms < 0 && tcl->waiter == NULL) {
+      r = FERROR;
+      break;
+    }
+    tcl_event_wait(tcl, ms);
+  }
+  tcl_name_free(tcl, tcl->watch);
+  tcl->watch = watch;
+  tcl->changed = 0;
+  return tcl_result(tcl, r, tcl_alloc("", 0));
+}
+#endif
+
+#ifndef TCL_DISABLE_MATH
+static int tcl_cmd_math(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  (void)argc;
+  const char *op = tcl_string(argv[0]);
+  long long a = tcl_wide(argv[1]);
+  long long b = tcl_wide(argv[2]);
+  long long c = 0;
+  /* Arithmetic wraps around instead of overflowing */
+  if (op[0] == '+') {
+    c = (long long)((unsigned long long)a + (unsigned long long)b);
+  } else if (op[0] == '-') {
+    c = (long long)((unsigned long long)a - (unsigned long long)b);
+  } else if (op[0] == '*') {
+    c = (long long)((unsigned long long)a * (unsigned long long)b);
+  } else if (op[0] == '/') {
+    if (b == 0) {
+      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+    }
+    c = (b == -1 ? (long long)(0 - (unsigned long long)a) : a / b);
+  } else if (op[0] == '>' && op[1] == '\0') {
+    c = a > b;
+  } else if (op[0] == '>' && op[1] == '=') {
+    c = a >= b;
+  } else if (op[0] == '<' && op[1] == '\0') {
+    c = a < b;
+  } else if (op[0] == '<' && op[1] == '=') {
+    c = a <= b;
+  } else if (op[0] == '=' && op[1] == '=') {
+    c = a == b;
+  } else if (op[0] == '!' && op[1] == '=') {
+    c = a != b;
+  }
+  return tcl_result(tcl, FNORMAL, tcl_alloc_wide(c));
+}
+
+/* Infix expressions are compiled into a postfix program that works on a
+ * stack of 64-bit integers. The program is kept in the expression value, so
+ * an expression in a loop or a procedure body is parsed only once. Operands
+ * are numbers, $variables and [commands], && and || don't evaluate the right
+ * operand if the result is known from the left one. */
+enum {
+  X_NUM,
+  X_VAR,
+  X_CMD,
+  X_NEG,
+  X_NOT,
+  X_INV,
+  X_BOOL,
+  X_JZ,
+  X_JNZ,
+  X_MUL,
+  X_DIV,
+  X_MOD,
+  X_ADD,
+  X_SUB,
+  X_SHL,
+  X_SHR,
+  X_LT,
+  X_GT,
+  X_LE,
+  X_GE,
+  X_EQ,
+  X_NE,
+  X_AND,
+  X_XOR,
+  X_OR
+};
+
+struct tcl_xop {
+  int op;
+  long long num; /* Number or jump target */
+  tcl_value_t *name;
+  struct tcl_code *code;
+};
+
+struct tcl_expr {
+  int refs;
+  struct tcl_allocator *mem;
+  struct tcl_xop *ops;
+  int nops;
+  int depth;
+};
+
+/* Binary operators, longer ones first */
+static const struct {
+  char s[3];
+  int op;
+  int prec;
+} tcl_xbin[] = {
+    {"||", X_JNZ, 1}, {"&&", X_JZ, 2},  {"<<", X_SHL, 8}, {">>", X_SHR, 8},
+    {"<=", X_LE, 7},  {">=", X_GE, 7},  {"==", X_EQ, 6},  {"!=", X_NE, 6},
+    {"|", X_OR, 3},   {"^", X_XOR, 4},  {"&", X_AND, 5},  {"<", X_LT, 7},
+    {">", X_GT, 7},   {"+", X_ADD, 9},  {"-", X_SUB, 9},  {"*", X_MUL, 10},
+    {"/", X_DIV, 10}, {"%", X_MOD, 10},
+};
+
+struct tcl_xparser {
+  struct tcl *tcl;
+  struct tcl_expr *expr;
+  const char *s;
+  const char *end;
+  int sp;
+  int err;
+};
+
+static void tcl_expr_free(struct tcl_expr *expr) {
+  if (expr == NULL || --expr->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < expr->nops; i++) {
+    tcl_free(expr->ops[i].name);
+    tcl_code_free(expr->ops[i].code);
+  }
+  tcl_mfree(expr->mem, expr->ops);
+  tcl_mfree(expr->mem, expr);
+}
+
+static struct tcl_xop *tcl_xemit(struct tcl_xparser *x, int op, long long num) {
+  struct tcl_expr *expr = x->expr;
+  expr->ops = tcl_realloc(expr->mem, expr->ops,
+                          (expr->nops + 1) * sizeof(struct tcl_xop));
+  struct tcl_xop *xop = &expr->ops[expr->nops++];
+  xop->op = op;
+  xop->num = num;
+  xop->name = NULL;
+  xop->code = NULL;
+  if (op <= X_CMD) {
+    x->sp++;
+  } else if (op >= X_JZ) {
+    x->sp--;
+  }
+  if (x->sp > expr->depth) {
+    expr->depth = x->sp;
+  }
+  return xop;
+}
+
+static void tcl_xspace(struct tcl_xparser *x) {
+  while (x->s < x->end && (tcl_is_space(*x->s) || *x->s == '\n' ||
+                           *x->s == '\r')) {
+    x->s++;
+  }
+}
+
+static int tcl_xname(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+static void tcl_xbinary(struct tcl_xparser *x, int prec);
+
+static void tcl_xunary(struct tcl_xparser *x) {
+  tcl_xspace(x);
+  if (x->s >= x->end) {
+    x->err = 1;
+    return;
+  }
+  char c = *x->s++;
+  if (c == '-' || c == '+' || c == '~' || c == '!') {
+    tcl_xunary(x);
+    if (c != '+') {
+      tcl_xemit(x, c == '-' ? X_NEG : (c == '~' ? X_INV : X_NOT), 0);
+    }
+  } else if (c == '(') {
+    tcl_xbinary(x, 1);
+    tcl_xspace(x);
+    if (x->s >= x->end || *x->s++ != ')') {
+      x->err = 1;
+    }
+  } else if (c >= '0' && c <= '9') {
+    unsigned long long n = 0;
+    int base = 10;
+    if (c == '0' && x->s < x->end && (*x->s == 'x' || *x->s == 'X')) {
+      base = 16;
+      x->s++;
+    } else {
+      n = c - '0';
+    }
+    for (; x->s < x->end; x->s++) {
+      c = *x->s;
+      int d = (c >= '0' && c <= '9')   ? c - '0'
+              : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+              : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                       : 99;
+      if (d >= base) {
+        break;
+      }
+      n = n * base + d;
+    }
+    tcl_xemit(x, X_NUM, (long long)n);
+  } else if (c == '$') {
+    int braced = (x->s < x->end && *x->s == '{');
+    const char *from = x->s + braced;
+    x->s = from;
+    while (x->s < x->end && (braced ? *x->s != '}' : tcl_xname(*x->s))) {
+      x->s++;
+    }
+    if (x->s == from || (braced && x->s == x->end)) {
+      x->err = 1;
+      return;
+    }
+    tcl_xemit(x, X_VAR, 0)->name =
+        tcl_alloc_mem(x->expr->mem, from, x->s - from);
+    x->s += braced;
+  } else if (c == '[') {
+    int depth = 1;
+    const char *from = x->s;
+    x->s += tcl_find_close(x->s, x->end - x->s, '[', &depth);
+    if (depth != 0) {
+      x->err = 1;
+      return;
+    }
+    /* The closing bracket takes the place of the terminator */
+    struct tcl_code *code = tcl_cached(x->tcl, from, x->s - from);
+    tcl_xemit(x, X_CMD, 0)->code = tcl_code_dup(code);
+  } else {
+    x->err = 1;
+  }
+}
+
+static void tcl_xbinary(struct tcl_xparser *x, int prec) {
+  tcl_xunary(x);
+  while (!x->err) {
+    unsigned int i;
+    tcl_xspace(x);
+    for (i = 0; i < sizeof(tcl_xbin) / sizeof(tcl_xbin[0]); i++) {
+      size_t n = strlen(tcl_xbin[i].s);
+      if ((size_t)(x->end - x->s) >= n &&
+          strncmp(x->s, tcl_xbin[i].s, n) == 0) {
+        break;
+      }
+    }
+    if (i == sizeof(tcl_xbin) / sizeof(tcl_xbin[0]) ||
+        tcl_xbin[i].prec < prec) {
+      return;
+    }
+    x->s += strlen(tcl_xbin[i].s);
+    if (tcl_xbin[i].op == X_JZ || tcl_xbin[i].op == X_JNZ) {
+      /* Jumps over the right operand if the left one decides the result */
+      int jump = x->expr->nops;
+      tcl_xemit(x, tcl_xbin[i].op, 0);
+      tcl_xbinary(x, tcl_xbin[i].prec + 1);
+      tcl_xemit(x, X_BOOL, 0);
+      x->expr->ops[jump].num = x->expr->nops;
+    } else {
+      tcl_xbinary(x, tcl_xbin[i].prec + 1);
+      tcl_xemit(x, tcl_xbin[i].op, 0);
+    }
+  }
+}
+
+/* Returns the compiled expression kept in the value, or NULL if the
+ * expression is invalid */
+static struct tcl_expr *tcl_expr_prepare(struct tcl *tcl, tcl_value_t *v) {
+  if (v->refs < 0) {
+    /* Frozen values can't keep it, a copy is compiled and cached instead */
+    size_t i = ((size_t)(void *)v / sizeof(tcl_value_t)) % TCL_EXPR_CACHE;
+    if (tcl->exprs[i].v != v) {
+      tcl_value_t *copy = tcl_alloc_mem(tcl->mem, tcl_string(v), tcl_length(v));
+      struct tcl_expr *expr = tcl_expr_prepare(tcl, copy);
+      if (expr != NULL) {
+        expr->refs++;
+      }
+      tcl_expr_free(tcl->exprs[i].expr);
+      tcl->exprs[i].v = (expr != NULL ? v : NULL);
+      tcl->exprs[i].expr = expr;
+      tcl_free(copy);
+    }
+    return tcl->exprs[i].expr;
+  }
+  if (v->type != TCL_EXPR) {
+    struct tcl_xparser x;
+    x.tcl = tcl;
+    x.expr = tcl_calloc(tcl->mem, sizeof(struct tcl_expr));
+    x.expr->refs = 1;
+    x.expr->mem = tcl->mem;
+    x.s = tcl_string(v);
+    x.end = x.s + tcl_length(v);
+    x.sp = 0;
+    x.err = 0;
+    tcl_xbinary(&x, 1);
+    tcl_xspace(&x);
+    if (x.err || x.s != x.end) {
+      tcl_expr_free(x.expr);
+      return NULL;
+    }
+    tcl_free_rep(v);
+    v->type = TCL_EXPR;
+    v->rep.expr = x.expr;
+  }
+  return v->rep.expr;
+}
+
+static int tcl_expr_next(struct tcl *tcl, int flow, int argc,
+                         tcl_value_t **argv, int state);
+
+/* Evaluates the expression in argv[1] from pc. A command substitution
+ * suspends it: the numbers on the stack are saved in place of the command
+ * name and the command runs in a frame, then tcl_expr_next() pushes its
+ * result and continues. So recursion through expressions doesn't grow the C
+ * stack, and a coroutine may yield inside of them. */
+static int tcl_expr_eval(struct tcl *tcl, tcl_value_t **argv, int pc) {
+  struct tcl_expr *expr = tcl_expr_prepare(tcl, argv[1]);
+  long long buf[16];
+  long long *stack = buf;
+  long long result;
+  int sp = 0;
+  int r = FNORMAL;
+  if (expr == NULL) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  if (expr->depth > 16) {
+    stack = tcl_malloc(tcl->mem, expr->depth * sizeof(*stack));
+  }
+  if (pc > 0) {
+    sp = (int)(argv[0]->len / sizeof(*stack));
+    memcpy(stack, tcl_bytes(argv[0]), sp * sizeof(*stack));
+    stack[sp++] = tcl_wide(tcl->result);
+  }
+  expr->refs++;
+  for (; pc < expr->nops && r == FNORMAL; pc++) {
+    struct tcl_xop *op = &expr->ops[pc];
+    unsigned long long a = 0;
+    unsigned long long b = 0;
+    if (op->op >= X_MUL) {
+      b = stack[--sp];
+      a = stack[sp - 1];
+    }
+    switch (op->op) {
+    case X_NUM:
+      stack[sp++] = op->num;
+      break;
+    case X_VAR:
+      stack[sp++] = tcl_wide(*tcl_var_slot(tcl, tcl_string(op->name)));
+      break;
+    case X_CMD:
+      tcl_free(argv[0]);
+      argv[0] = tcl_alloc((const char *)stack, sp * sizeof(*stack));
+      r = tcl_then_code(tcl, op->code, tcl_expr_next, pc + 1);
+      break;
+    case X_NEG:
+      stack[sp - 1] = (long long)(0 - (unsigned long long)stack[sp - 1]);
+      break;
+    case X_NOT:
+      stack[sp - 1] = !stack[sp - 1];
+      break;
+    case X_INV:
+      stack[sp - 1] = ~stack[sp - 1];
+      break;
+    case X_BOOL:
+      stack[sp - 1] = (stack[sp - 1] != 0);
+      break;
+    case X_JZ:
+    case X_JNZ:
+      if ((stack[sp - 1] != 0) == (op->op == X_JNZ)) {
+        stack[sp - 1] = (op->op == X_JNZ);
+        pc = (int)op->num - 1;
+      } else {
+        sp--;
+      }
+      break;
+    case X_DIV:
+    case X_MOD:
+      if (b == 0) {
+        r = FERROR;
+      } else if (b == (unsigned long long)-1) {
+        /* Avoids the overflow of the smallest number divided by -1 */
+        stack[sp - 1] = (op->op == X_DIV ? (long long)(0 - a) : 0);
+      } else if (op->op == X_DIV) {
+        stack[sp - 1] = (long long)a / (long long)b;
+      } else {
+        stack[sp - 1] = (long long)a % (long long)b;
+      }
+      break;
+    case X_MUL:
+      stack[sp - 1] = (long long)(a * b);
+      break;
+    case X_ADD:
+      stack[sp - 1] = (long long)(a + b);
+      break;
+    case X_SUB:
+      stack[sp - 1] = (long long)(a - b);
+      break;
+    case X_SHL:
+      stack[sp - 1] = (long long)(a << (b & 63));
+      break;
+    case X_SHR:
+      stack[sp - 1] = (long long)a >> (b & 63);
+      break;
+    case X_LT:
+      stack[sp - 1] = (long long)a < (long long)b;
+      break;
+    case X_GT:
+      stack[sp - 1] = (long long)a > (long long)b;
+      break;
+    case X_LE:
+      stack[sp - 1] = (long long)a <= (long long)b;
+      break;
+    case X_GE:
+      stack[sp - 1] = (long long)a >= (long long)b;
+      break;
+    case X_EQ:
+      stack[sp - 1] = (a == b);
+      break;
+    case X_NE:
+      stack[sp - 1] = (a != b);
+      break;
+    case X_AND:
+      stack[sp - 1] = (long long)(a & b);
+      break;
+    case X_XOR:
+      stack[sp - 1] = (long long)(a ^ b);
+      break;
+    case X_OR:
+      stack[sp - 1] = (long long)(a | b);
+      break;
+    }
   }
-  tcl_free(flowval);
-  return r;
+  result = (sp > 0 ? stack[sp - 1] : 0);
+  if (stack != buf) {
+    tcl_mfree(tcl->mem, stack);
+  }
+  tcl_expr_free(expr);
+  if (r == FNORMAL) {
+    return tcl_result(tcl, FNORMAL, tcl_alloc_wide(result));
+  }
+  return r == FERROR ? tcl_result(tcl, FERROR, tcl_alloc("", 0)) : r;
 }
 
-static int tcl_cmd_while(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  (void)arg;
-  tcl_value_t *cond = tcl_list_at(args, 1);
-  tcl_value_t *loop = tcl_list_at(args, 2);
-  int r;
-  for (;;) {
-    r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
-    if (r != FNORMAL) {
-      tcl_free(cond);
-      tcl_free(loop);
-      return r;
-    }
-    if (!tcl_int(tcl->result)) {
-      tcl_free(cond);
-      tcl_free(loop);
-      return FNORMAL;
-    }
-    int r = tcl_eval(tcl, tcl_string(loop), tcl_length(loop) + 1);
-    switch (r) {
-    case FBREAK:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FNORMAL;
-    case FRETURN:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FRETURN;
-    case FAGAIN:
-      continue;
-    case FERROR:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FERROR;
-    }
+static int tcl_expr_next(struct tcl *tcl, int flow, int argc,
+                         tcl_value_t **argv, int state) {
+  (void)argc;
+  if (flow != FNORMAL) {
+    return flow == FERROR ? tcl_result(tcl, FERROR, tcl_alloc("", 0)) : flow;
   }
+  return tcl_expr_eval(tcl, argv, state);
 }
 
-#ifndef TCL_DISABLE_MATH
-static int tcl_cmd_math(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_expr(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
   (void)arg;
-  char buf[64];
-  tcl_value_t *opval = tcl_list_at(args, 0);
-  tcl_value_t *aval = tcl_list_at(args, 1);
-  tcl_value_t *bval = tcl_list_at(args, 2);
-  const char *op = tcl_string(opval);
-  int a = tcl_int(aval);
-  int b = tcl_int(bval);
-  int c = 0;
-  if (op[0] == '+') {
-    c = a + b;
-  } else if (op[0] == '-') {
-    c = a - b;
-  } else if (op[0] == '*') {
-    c = a * b;
-  } else if (op[0] == '/') {
-    c = a / b;
-  } else if (op[0] == '>' && op[1] == '\0') {
-    c = a > b;
-  } else if (op[0] == '>' && op[1] == '=') {
-    c = a >= b;
-  } else if (op[0] == '<' && op[1] == '\0') {
-    c = a < b;
-  } else if (op[0] == '<' && op[1] == '=') {
-    c = a <= b;
-  } else if (op[0] == '=' && op[1] == '=') {
-    c = a == b;
-  } else if (op[0] == '!' && op[1] == '=') {
-    c = a != b;
-  }
-
-  char *p = buf + sizeof(buf) - 1;
-  char neg = (c < 0);
-  *p-- = 0;
-  if (neg) {
-    c = -c;
+  if (argc < 2) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
   }
-  do {
-    *p-- = '0' + (c % 10);
-    c = c / 10;
-  } while (c > 0);
-  if (neg) {
-    *p-- = '-';
+  if (argc > 2) {
+    /* Multiple words are joined with spaces into one expression */
+    tcl_value_t *v = tcl_dup(argv[1]);
+    for (int i = 2; i < argc; i++) {
+      v = tcl_append_string(v, " ", 1);
+      v = tcl_append_string(v, tcl_string(argv[i]), tcl_length(argv[i]));
+    }
+    tcl_free(argv[1]);
+    argv[1] = v;
   }
-  p++;
-
-  tcl_free(opval);
-  tcl_free(aval);
-  tcl_free(bval);
-  return tcl_result(tcl, FNORMAL, tcl_alloc(p, strlen(p)));
+  return tcl_expr_eval(tcl, argv, 0);
 }
 #endif
 
-void tcl_init(struct tcl *tcl) {
-  tcl->env = tcl_env_alloc(NULL);
-  tcl->result = tcl_alloc("", 0);
-  tcl->cmds = NULL;
-  tcl_register(tcl, "set", tcl_cmd_set, 0, NULL);
-  tcl_register(tcl, "subst", tcl_cmd_subst, 2, NULL);
+/* Initializes an interpreter without any commands */
+static void tcl_init_empty(struct tcl *tcl, struct tcl_allocator *mem) {
+  tcl->mem = mem;
+  tcl->arena = NULL;
+  tcl->env = NULL;
+  tcl->frames = NULL;
+  tcl->slots = NULL;
+  tcl->nslots = tcl->capslots = 0;
+  tcl->env = tcl_env_alloc(tcl, NULL);
+  tcl->result = &tcl_empty;
+  tcl->nbuckets = 16;
+  tcl->ncmds = 0;
+  tcl->epoch = 0;
+  tcl->cmds = tcl_calloc(mem, tcl->nbuckets * sizeof(struct tcl_cmd *));
+  tcl->names = NULL;
+  tcl->namebuckets = 0;
+  tcl->nnames = 0;
+  memset(tcl->cache, 0, sizeof(tcl->cache));
+  memset(&tcl->stack, 0, sizeof(tcl->stack));
+  tcl->stack.heap = mem;
+  tcl->stack.chunk = 8192;
+  tcl->depth = 0;
+  tcl->coro = NULL;
+#ifndef TCL_DISABLE_EVENTS
+  tcl->events = NULL;
+  tcl->nevents = tcl->capevents = 0;
+  tcl->nextevent = 0;
+  tcl->eventpos = NULL;
+  tcl->watch = NULL;
+  tcl->changed = 0;
+  tcl->waiter = NULL;
+  tcl->waiterarg = NULL;
+#endif
+#ifdef TCL_ENABLE_STATS
+  memset(tcl->shadows, 0, sizeof(tcl->shadows));
+#endif
+  tcl->parent = NULL;
+  tcl->frozen = 0;
+  tcl->snap = NULL;
+  tcl->nsnap = 0;
+  tcl->clones = 0;
+#ifdef TCL_POOL
+  tcl->pool = NULL;
+  tcl->next = NULL;
+#endif
+#ifndef TCL_DISABLE_MATH
+  memset(tcl->exprs, 0, sizeof(tcl->exprs));
+#endif
+}
+
+void tcl_init_alloc(struct tcl *tcl, struct tcl_allocator *mem) {
+  tcl_init_empty(tcl, mem);
+  tcl_register_argv(tcl, "set", tcl_cmd_set, 0, NULL);
+  tcl_register_argv(tcl, "subst", tcl_cmd_subst, 2, NULL);
 #ifndef TCL_DISABLE_PUTS
-  tcl_register(tcl, "puts", tcl_cmd_puts, 2, NULL);
-#endif
-  tcl_register(tcl, "proc", tcl_cmd_proc, 4, NULL);
-  tcl_register(tcl, "if", tcl_cmd_if, 0, NULL);
-  tcl_register(tcl, "while", tcl_cmd_while, 3, NULL);
-  tcl_register(tcl, "return", tcl_cmd_flow, 0, NULL);
-  tcl_register(tcl, "break", tcl_cmd_flow, 1, NULL);
-  tcl_register(tcl, "continue", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "puts", tcl_cmd_puts, 2, NULL);
+#endif
+  tcl_register_argv(tcl, "proc", tcl_cmd_proc, 4, NULL);
+  tcl_register_argv(tcl, "if", tcl_cmd_if, 0, NULL);
+  tcl_register_argv(tcl, "while", tcl_cmd_while, 3, NULL);
+  tcl_register_argv(tcl, "return", tcl_cmd_flow, 0, NULL);
+  tcl_register_argv(tcl, "break", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "continue", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "yield", tcl_cmd_yield, 0, NULL);
+#ifndef TCL_DISABLE_EVENTS
+  tcl_register_argv(tcl, "after", tcl_cmd_after, 0, NULL);
+  tcl_register_argv(tcl, "update", tcl_cmd_update, 1, NULL);
+  tcl_register_argv(tcl, "vwait", tcl_cmd_vwait, 2, NULL);
+#endif
 #ifndef TCL_DISABLE_MATH
   char *math[] = {"+", "-", "*", "/", ">", ">=", "<", "<=", "==", "!="};
   for (unsigned int i = 0; i < (sizeof(math) / sizeof(math[0])); i++) {
-    tcl_register(tcl, math[i], tcl_cmd_math, 3, NULL);
+    tcl_register_argv(tcl, math[i], tcl_cmd_math, 3, NULL);
   }
+  tcl_register_argv(tcl, "expr", tcl_cmd_expr, 0, NULL);
+#endif
+#ifdef TCL_ENABLE_STATS
+  tcl_register_argv(tcl, "stats", tcl_cmd_stats, 0, NULL);
 #endif
 }
 
+void tcl_init(struct tcl *tcl) { tcl_init_alloc(tcl, &tcl_heap); }
+
+/* Values created with tcl_alloc() outside of an evaluation use the heap, these
+ * use the allocator of the interpreter */
+tcl_value_t *tcl_alloc_in(struct tcl *tcl, const char *s, size_t len) {
+  return len == 0 ? &tcl_empty : tcl_alloc_mem(tcl->mem, s, len);
+}
+
+tcl_value_t *tcl_list_alloc_in(struct tcl *tcl) {
+  return tcl_list_new(tcl->mem, 0);
+}
+
+/* Enables the arena for values created while commands are evaluated. Such
+ * values are valid until the command that created them returns, values that
+ * are kept longer must be passed through tcl_keep(). */
+void tcl_use_arena(struct tcl *tcl, size_t chunk) {
+  if (tcl->arena == NULL) {
+    tcl->arena = tcl_calloc(tcl->mem, sizeof(struct tcl_arena));
+    tcl->arena->mem.realloc = tcl_arena_realloc;
+    tcl->arena->mem.ctx = tcl->arena;
+    tcl->arena->heap = tcl->mem;
+  }
+  tcl->arena->chunk = chunk;
+}
+
+/* Freezes global variables and procedure bodies of the interpreter, so that
+ * clones can share them. The snapshot must not be modified afterwards. */
+void tcl_snapshot(struct tcl *tcl) {
+  int n = 0;
+  if (tcl->frozen) {
+    return;
+  }
+  tcl->frozen = 1;
+  for (struct tcl_var *var = tcl->env->vars; var != NULL; var = var->next) {
+    n++;
+  }
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+      n += (cmd->argv_fn == tcl_user_proc);
+    }
+  }
+  if (n > 0) {
+    tcl->snap = tcl_malloc(tcl->mem, n * sizeof(tcl_value_t *));
+  }
+  /* Clones use the names of the snapshot without reference counting */
+  for (int i = 0; i < tcl->namebuckets; i++) {
+    for (struct tcl_name *name = tcl->names[i]; name; name = name->next) {
+      name->refs = -1;
+    }
+  }
+  for (struct tcl_var *var = tcl->env->vars; var != NULL; var = var->next) {
+    /* Values may be shared with scripts, frozen values are private copies */
+    tcl_value_t *v = tcl_alloc_mem(tcl->mem, tcl_string(var->value),
+                                   tcl_length(var->value));
+    if (var->value->type == TCL_INT) {
+      v->type = TCL_INT;
+      v->rep.i = var->value->rep.i;
+    }
+    v->refs = -1;
+    tcl_free(var->value);
+    var->value = tcl->snap[tcl->nsnap++] = v;
+  }
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+      if (cmd->argv_fn == tcl_user_proc) {
+        struct tcl_proc *proc = (struct tcl_proc *)cmd->arg;
+        tcl_value_t *body = tcl_alloc_mem(tcl->mem, tcl_string(proc->body),
+                                          tcl_length(proc->body));
+        body->type = TCL_CODE;
+        body->rep.code =
+            tcl_compile(tcl->mem, body->s, body->len + 1, NULL);
+        tcl_code_freeze(body->rep.code);
+        body->refs = -1;
+        tcl_free(proc->body);
+        proc->body = tcl->snap[tcl->nsnap++] = body;
+      }
+    }
+  }
+}
+
+/* Creates an interpreter that shares commands and global variables with the
+ * snapshot, without copying them. New commands and variables of the clone
+ * shadow the ones of the snapshot, globals are copied when they are first
+ * used. The snapshot must outlive its clones. */
+void tcl_clone(struct tcl *tcl, struct tcl *snapshot) {
+  tcl_snapshot(snapshot);
+  tcl_init_empty(tcl, snapshot->mem);
+  tcl->parent = snapshot;
+  snapshot->clones++;
+}
+
 void tcl_destroy(struct tcl *tcl) {
+  if (tcl->parent != NULL) {
+    tcl->parent->clones--;
+  }
   while (tcl->env) {
-    tcl->env = tcl_env_free(tcl->env);
+    tcl->env = tcl_env_free(tcl, tcl->env);
+  }
+  while (tcl->frames) {
+    struct tcl_env *env = tcl->frames;
+    tcl->frames = env->parent;
+    tcl_mfree(tcl->mem, env);
+  }
+  tcl_mfree(tcl->mem, tcl->slots);
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    while (tcl->cmds[i]) {
+      struct tcl_cmd *cmd = tcl->cmds[i];
+      tcl->cmds[i] = cmd->next;
+      tcl_name_free(tcl, cmd->name);
+      if (cmd->argv_fn == tcl_user_proc) {
+        tcl_proc_free(tcl, cmd->arg);
+      } else {
+        free(cmd->arg);
+      }
+      tcl_mfree(tcl->mem, cmd);
+    }
+  }
+  tcl_mfree(tcl->mem, tcl->cmds);
+#ifdef TCL_ENABLE_STATS
+  for (int i = 0; i < TCL_SHADOWS; i++) {
+    while (tcl->shadows[i] != NULL) {
+      struct tcl_shadow *shadow = tcl->shadows[i];
+      tcl->shadows[i] = shadow->next;
+      tcl_mfree(tcl->mem, shadow);
+    }
+  }
+#endif
+  /* Only the frozen names of a snapshot are left */
+  for (int i = 0; i < tcl->namebuckets; i++) {
+    while (tcl->names[i] != NULL) {
+      struct tcl_name *name = tcl->names[i];
+      tcl->names[i] = name->next;
+      tcl_mfree(tcl->mem, name);
+    }
   }
-  while (tcl->cmds) {
-    struct tcl_cmd *cmd = tcl->cmds;
-    tcl->cmds = tcl->cmds->next;
-    tcl_free(cmd->name);
-    free(cmd->arg);
-    free(cmd);
+  tcl_mfree(tcl->mem, tcl->names);
+  for (int i = 0; i < TCL_CODE_CACHE; i++) {
+    tcl_code_free(tcl->cache[i]);
   }
+#ifndef TCL_DISABLE_MATH
+  for (int i = 0; i < TCL_EXPR_CACHE; i++) {
+    tcl_expr_free(tcl->exprs[i].expr);
+  }
+#endif
   tcl_free(tcl->result);
+#ifndef TCL_DISABLE_EVENTS
+  while (tcl->nevents > 0) {
+    tcl_event_remove(tcl, tcl->nevents - 1);
+  }
+  tcl_mfree(tcl->mem, tcl->events);
+  tcl_mfree(tcl->mem, tcl->eventpos);
+#endif
+  tcl_arena_free(&tcl->stack);
+  if (tcl->arena != NULL) {
+    tcl_arena_free(tcl->arena);
+    tcl_mfree(tcl->mem, tcl->arena);
+  }
+  /* Nothing else owns the frozen values, constants are never among them */
+  for (int i = 0; i < tcl->nsnap; i++) {
+    tcl_value_t *v = tcl->snap[i];
+    if (v->type == TCL_CODE) {
+      tcl_code_thaw(v->rep.code);
+    }
+    v->refs = 1;
+    tcl_free(v);
+  }
+  tcl_mfree(tcl->mem, tcl->snap);
 }
 
-#ifndef TEST
-#define CHUNK 1024
+#ifdef TCL_POOL
+/* Creates a pool, interpreters are allocated with mem (which must be safe to
+ * use from several threads) and prepared with init(tcl, arg) */
+void tcl_pool_init(struct tcl_pool *pool, struct tcl_allocator *mem,
+                   void (*init)(struct tcl *tcl, void *arg), void *arg) {
+  pool->mem = mem;
+  pool->init = init;
+  pool->arg = arg;
+  atomic_flag_clear(&pool->lock);
+  pool->idle = NULL;
+  for (int i = 0; i < TCL_POOL_CACHE; i++) {
+    atomic_init(&pool->cache[i], NULL);
+  }
+}
 
-int main(void) {
-  struct tcl tcl;
-  int buflen = CHUNK;
-  char *buf = malloc(buflen);
-  int i = 0;
+/* Takes an idle interpreter from the pool, or creates a new one */
+struct tcl *tcl_pool_acquire(struct tcl_pool *pool) {
+  while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {
+  }
+  struct tcl *tcl = pool->idle;
+  if (tcl != NULL) {
+    pool->idle = tcl->next;
+  }
+  atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+  if (tcl == NULL) {
+    tcl = tcl_malloc(pool->mem, sizeof(struct tcl));
+    tcl_init_alloc(tcl, pool->mem);
+    tcl->pool = pool;
+    if (pool->init != NULL) {
+      pool->init(tcl, pool->arg);
+    }
+  }
+  return tcl;
+}
 
-  tcl_init(&tcl);
-  while (1) {
-    int inp = fgetc(stdin);
+/* Returns the interpreter to the pool, it keeps its commands and variables */
+void tcl_pool_release(struct tcl_pool *pool, struct tcl *tcl) {
+  while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {
+  }
+  tcl->next = pool->idle;
+  pool->idle = tcl;
+  atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+}
+
+/* Destroys the idle interpreters and the shared scripts, all interpreters
+ * must have been released */
+void tcl_pool_destroy(struct tcl_pool *pool) {
+  while (pool->idle != NULL) {
+    struct tcl *tcl = pool->idle;
+    pool->idle = tcl->next;
+    tcl_destroy(tcl);
+    tcl_mfree(pool->mem, tcl);
+  }
+  for (int i = 0; i < TCL_POOL_CACHE; i++) {
+    struct tcl_code *code = atomic_load(&pool->cache[i]);
+    if (code != NULL) {
+      tcl_code_thaw(code);
+      tcl_code_free(code);
+    }
+  }
+}
+#endif
+
+#ifndef TCL_DISABLE_IMAGE
+/* Images keep compiled scripts, procedures and global variables in the same
+ * form as they are kept in memory, so loading an image takes no parsing and
+ * no copying. Pointers are stored as offsets from the start of the image and
+ * are listed in a relocation table, the loader turns them into addresses in
+ * place. Values and code in an image are frozen. Images depend on the layout
+ * of the structures, so they can only be loaded by a compatible build. */
+#define TCL_IMAGE_VERSION 2
+
+struct tcl_image_proc {
+  tcl_value_t *name;
+  tcl_value_t **locals;
+  int nlocals;
+  int nparams;
+  tcl_value_t *body;
+};
+
+struct tcl_image_var {
+  tcl_value_t *name;
+  tcl_value_t *value;
+};
+
+struct tcl_image {
+  char magic[4];
+  unsigned int version;
+  unsigned long long layout;
+  size_t size;
+  struct tcl_image *base; /* Address that the image was relocated for */
+  struct tcl_code *script;
+  struct tcl_image_proc *procs;
+  int nprocs;
+  struct tcl_image_var *globals;
+  int nglobals;
+  size_t relocs; /* Offset of the relocation table */
+  size_t nrelocs;
+};
+
+static unsigned long long tcl_image_layout(void) {
+  unsigned int one = 1;
+  return sizeof(tcl_value_t) | sizeof(struct tcl_code) << 12 |
+         (unsigned long long)sizeof(struct tcl_site) << 24 |
+         (unsigned long long)sizeof(struct tcl_vsite) << 36 |
+         (unsigned long long)sizeof(void *) << 48 |
+         (unsigned long long)*(unsigned char *)&one << 56;
+}
+
+struct tcl_image_writer {
+  struct tcl_allocator *mem;
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t *relocs;
+  size_t nrelocs;
+  size_t caprelocs;
+};
+
+/* Appends a block (or zeroes if data is NULL), returns its offset */
+static size_t tcl_image_put(struct tcl_image_writer *w, const void *data,
+                            size_t size) {
+  size_t off = (w->len + 15) & ~(size_t)15;
+  if (off + size > w->cap) {
+    w->cap = (w->cap * 2 > off + size ? w->cap * 2 : off + size);
+    w->buf = tcl_realloc(w->mem, w->buf, w->cap);
+  }
+  memset(w->buf + w->len, 0, off - w->len);
+  if (data != NULL) {
+    memcpy(w->buf + off, data, size);
+  } else {
+    memset(w->buf + off, 0, size);
+  }
+  w->len = off + size;
+  return off;
+}
+
+/* Points a pointer field of the image at the block with the given offset */
+static void tcl_image_ptr(struct tcl_image_writer *w, size_t field,
+                          size_t target) {
+  memcpy(w->buf + field, &target, sizeof(target));
+  if (w->nrelocs == w->caprelocs) {
+    w->caprelocs = (w->caprelocs == 0 ? 64 : w->caprelocs * 2);
+    w->relocs =
+        tcl_realloc(w->mem, w->relocs, w->caprelocs * sizeof(size_t));
+  }
+  w->relocs[w->nrelocs++] = field;
+}
+
+static size_t tcl_image_code(struct tcl_image_writer *w,
+                             struct tcl_code *code);
+
+static size_t tcl_image_value(struct tcl_image_writer *w, tcl_value_t *v) {
+  tcl_value_t copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.refs = -1;
+  copy.type = (v->type == TCL_INT || v->type == TCL_CODE ? v->type
+                                                          : TCL_STRING);
+  copy.len = tcl_length(v);
+  copy.cap = copy.len + 1;
+  if (v->type == TCL_INT) {
+    copy.rep.i = v->rep.i;
+  }
+  size_t off = tcl_image_put(w, &copy, sizeof(copy));
+  tcl_image_ptr(w, off + offsetof(tcl_value_t, s),
+                tcl_image_put(w, tcl_string(v), copy.len + 1));
+  if (v->type == TCL_CODE) {
+    tcl_image_ptr(w, off + offsetof(tcl_value_t, rep.code),
+                  tcl_image_code(w, v->rep.code));
+  }
+  return off;
+}
+
+/* Names are written as values, the loader interns them again */
+static size_t tcl_image_name(struct tcl_image_writer *w,
+                             struct tcl_name *name) {
+  tcl_value_t *v = tcl_alloc_mem(w->mem, name->s, name->len);
+  size_t off = tcl_image_value(w, v);
+  tcl_free(v);
+  return off;
+}
+
+/* Code is written as it was compiled, call site caches are empty */
+static size_t tcl_image_code(struct tcl_image_writer *w,
+                             struct tcl_code *code) {
+  struct tcl_code copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.refs = -1;
+  copy.nops = code->nops;
+  copy.depth = code->depth;
+  copy.nlits = code->nlits;
+  copy.nsubs = code->nsubs;
+  copy.nsites = code->nsites;
+  copy.nvsites = code->nvsites;
+  size_t off = tcl_image_put(w, &copy, sizeof(copy));
+  if (code->nops > 0) {
+    tcl_image_ptr(w, off + offsetof(struct tcl_code, ops),
+                  tcl_image_put(w, code->ops, code->nops * sizeof(int)));
+  }
+  if (code->nlits > 0) {
+    size_t lits = tcl_image_put(w, NULL, code->nlits * sizeof(tcl_value_t *));
+    tcl_image_ptr(w, off + offsetof(struct tcl_code, lits), lits);
+    for (int i = 0; i < code->nlits; i++) {
+      tcl_image_ptr(w, lits + i * sizeof(tcl_value_t *),
+                    tcl_image_value(w, code->lits[i]));
+    }
+  }
+  if (code->nsubs > 0) {
+    size_t subs =
+        tcl_image_put(w, NULL, code->nsubs * sizeof(struct tcl_code *));
+    tcl_image_ptr(w, off + offsetof(struct tcl_code, subs), subs);
+    for (int i = 0; i < code->nsubs; i++) {
+      tcl_image_ptr(w, subs + i * sizeof(struct tcl_code *),
+                    tcl_image_code(w, code->subs[i]));
+    }
+  }
+  if (code->nsites > 0) {
+    size_t sites = tcl_image_put(w, NULL, code->nsites * sizeof(*code->sites));
+    tcl_image_ptr(w, off + offsetof(struct tcl_code, sites), sites);
+    for (int i = 0; i < code->nsites; i++) {
+      struct tcl_site *site = (struct tcl_site *)(void *)(w->buf + sites);
+      site[i].words = code->sites[i].words;
+      site[i].named = code->sites[i].named;
+    }
+  }
+  if (code->nvsites > 0) {
+    size_t vsites =
+        tcl_image_put(w, NULL, code->nvsites * sizeof(*code->vsites));
+    tcl_image_ptr(w, off + offsetof(struct tcl_code, vsites), vsites);
+    for (int i = 0; i < code->nvsites; i++) {
+      struct tcl_vsite *vs = (struct tcl_vsite *)(void *)(w->buf + vsites);
+      vs[i].lit = code->vsites[i].lit;
+    }
+  }
+  return off;
+}
+
+/* Compiles a script (or a procedure body) for the image */
+static size_t tcl_image_script(struct tcl_image_writer *w, const char *s,
+                               size_t len, int value) {
+  tcl_value_t *v = tcl_alloc_mem(w->mem, s, value ? len - 1 : len);
+  struct tcl_code *code = tcl_compile(w->mem, s, len, NULL);
+  size_t off;
+  tcl_code_freeze(code);
+  if (value) {
+    v->type = TCL_CODE;
+    v->rep.code = code;
+    off = tcl_image_value(w, v);
+  } else {
+    off = tcl_image_code(w, code);
+  }
+  tcl_code_thaw(code);
+  tcl_code_free(code);
+  v->type = TCL_STRING;
+  tcl_free(v);
+  return off;
+}
+
+/* Saves the script (if it's not NULL) compiled, and the procedures and global
+ * variables of the interpreter. The image is allocated with the allocator of
+ * the interpreter. */
+void *tcl_image_save(struct tcl *tcl, const char *s, size_t len,
+                     size_t *size) {
+  struct tcl_image_writer w = {tcl->mem, NULL, 0, 0, NULL, 0, 0};
+  struct tcl_image h;
+  struct tcl_env *global = tcl->env;
+  int n = 0;
+  while (global->parent != NULL) {
+    global = global->parent;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "PTCL", 4);
+  h.version = TCL_IMAGE_VERSION;
+  h.layout = tcl_image_layout();
+  tcl_image_put(&w, &h, sizeof(h));
+  if (s != NULL) {
+    tcl_image_ptr(&w, offsetof(struct tcl_image, script),
+                  tcl_image_script(&w, s, len, 0));
+  }
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+      n += (cmd->argv_fn == tcl_user_proc);
+    }
+  }
+  size_t procs = tcl_image_put(&w, NULL, n * sizeof(struct tcl_image_proc));
+  tcl_image_ptr(&w, offsetof(struct tcl_image, procs), procs);
+  ((struct tcl_image *)(void *)w.buf)->nprocs = n;
+  for (int i = 0; i < tcl->nbuckets; i++) {
+    for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+      if (cmd->argv_fn != tcl_user_proc) {
+        continue;
+      }
+      struct tcl_proc *proc = (struct tcl_proc *)cmd->arg;
+      size_t locals =
+          tcl_image_put(&w, NULL, proc->nlocals * sizeof(tcl_value_t *));
+      for (int j = 0; j < proc->nlocals; j++) {
+        tcl_image_ptr(&w, locals + j * sizeof(tcl_value_t *),
+                      tcl_image_name(&w, proc->locals[j]));
+      }
+      size_t name = tcl_image_name(&w, cmd->name);
+      size_t body = tcl_image_script(&w, tcl_string(proc->body),
+                                     tcl_length(proc->body) + 1, 1);
+      struct tcl_image_proc *p =
+          (struct tcl_image_proc *)(void *)(w.buf + procs);
+      p->nlocals = proc->nlocals;
+      p->nparams = proc->nparams;
+      tcl_image_ptr(&w, procs + offsetof(struct tcl_image_proc, name), name);
+      tcl_image_ptr(&w, procs + offsetof(struct tcl_image_proc, locals),
+                    locals);
+      tcl_image_ptr(&w, procs + offsetof(struct tcl_image_proc, body), body);
+      procs += sizeof(struct tcl_image_proc);
+    }
+  }
+  n = 0;
+  for (struct tcl_var *var = global->vars; var != NULL; var = var->next) {
+    n++;
+  }
+  size_t vars = tcl_image_put(&w, NULL, n * sizeof(struct tcl_image_var));
+  tcl_image_ptr(&w, offsetof(struct tcl_image, globals), vars);
+  ((struct tcl_image *)(void *)w.buf)->nglobals = n;
+  for (struct tcl_var *var = global->vars; var != NULL; var = var->next) {
+    size_t name = tcl_image_name(&w, var->name);
+    size_t value = tcl_image_value(&w, var->value);
+    tcl_image_ptr(&w, vars + offsetof(struct tcl_image_var, name), name);
+    tcl_image_ptr(&w, vars + offsetof(struct tcl_image_var, value), value);
+    vars += sizeof(struct tcl_image_var);
+  }
+  size_t relocs = tcl_image_put(&w, w.relocs, w.nrelocs * sizeof(size_t));
+  struct tcl_image *image = (struct tcl_image *)(void *)w.buf;
+  image->relocs = relocs;
+  image->nrelocs = w.nrelocs;
+  image->size = w.len;
+  tcl_mfree(w.mem, w.relocs);
+  *size = w.len;
+  return w.buf;
+}
+
+/* Relocates the image (unless it's done already), validating it first */
+static int tcl_image_relocate(struct tcl_image *h, size_t size) {
+  char *base = (char *)h;
+  if (size < sizeof(*h) || memcmp(h->magic, "PTCL", 4) != 0 ||
+      h->version != TCL_IMAGE_VERSION || h->layout != tcl_image_layout() ||
+      h->size != size || h->relocs > size ||
+      h->nrelocs > (size - h->relocs) / sizeof(size_t)) {
+    return 0;
+  }
+  if (h->base == h) {
+    return 1;
+  }
+  size_t *relocs = (size_t *)(void *)(base + h->relocs);
+  for (size_t i = 0; i < h->nrelocs; i++) {
+    size_t target;
+    if (relocs[i] > size - sizeof(void *)) {
+      return 0;
+    }
+    memcpy(&target, base + relocs[i], sizeof(target));
+    if (target >= size) {
+      return 0;
+    }
+  }
+  for (size_t i = 0; i < h->nrelocs; i++) {
+    size_t target;
+    memcpy(&target, base + relocs[i], sizeof(target));
+    char *p = base + target;
+    memcpy(base + relocs[i], &p, sizeof(p));
+  }
+  h->base = h;
+  return 1;
+}
+
+/* Defines the procedures and global variables of the image and runs its
+ * script. The image must be writable (e.g. a private mapping of a file) and
+ * stay in memory as long as the interpreter uses it. Images are trusted like
+ * scripts, the compiled code is not validated. */
+int tcl_image_load(struct tcl *tcl, void *image, size_t size) {
+  struct tcl_image *h = (struct tcl_image *)image;
+  struct tcl_env *env = tcl->env;
+  if (!tcl_image_relocate(h, size)) {
+    return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+  }
+  for (int i = 0; i < h->nprocs; i++) {
+    struct tcl_image_proc *p = &h->procs[i];
+    struct tcl_proc *proc = tcl_calloc(tcl->mem, sizeof(struct tcl_proc));
+    proc->locals =
+        tcl_malloc(tcl->mem, p->nlocals * sizeof(struct tcl_name *));
+    for (int j = 0; j < p->nlocals; j++) {
+      proc->locals[j] = tcl_intern(tcl, tcl_string(p->locals[j]),
+                                   p->locals[j]->len);
+    }
+    proc->nlocals = p->nlocals;
+    proc->nparams = p->nparams;
+    proc->body = p->body;
+    tcl_register_argv(tcl, tcl_string(p->name), tcl_user_proc, 0, proc);
+  }
+  while (tcl->env->parent != NULL) {
+    tcl->env = tcl->env->parent;
+  }
+  for (int i = 0; i < h->nglobals; i++) {
+    tcl_var(tcl, tcl_string(h->globals[i].name), h->globals[i].value);
+  }
+  tcl->env = env;
+  if (h->script != NULL) {
+    return tcl_exec(tcl, h->script);
+  }
+  return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+}
+#endif
+
+/* Incremental reader for the interactive shell. Input is appended to a buffer
+ * and complete commands are taken from it. The lexer state is kept between
+ * calls. An incomplete token is scanned from where the previous block ended:
+ * for {...} and [...] the nesting depth is tracked, for words and strings the
+ * reader waits for a character that ends them. Every byte is scanned at most
+ * twice, the second time when its token is complete. */
+struct tcl_reader {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t cmd;   /* Start of the current command */
+  size_t pos;   /* Start of the next token */
+  size_t scan;  /* End of the scanned part of an incomplete token */
+  int depth;    /* Nesting depth of the incomplete {...} token, or zero */
+  int part;     /* The incomplete token is a word part */
+  int skip;     /* The rest of an invalid command is dropped */
+  int q;
+};
+
+void tcl_reader_init(struct tcl_reader *r) { memset(r, 0, sizeof(*r)); }
+
+void tcl_reader_free(struct tcl_reader *r) { tcl_mfree(&tcl_heap, r->buf); }
+
+void tcl_reader_feed(struct tcl_reader *r, const char *s, size_t n) {
+  if (r->len + n + 1 > r->cap && r->cmd > 0 && r->cmd >= r->len - r->cmd) {
+    /* Drop the commands that were taken, moving no more bytes than dropped */
+    memmove(r->buf, r->buf + r->cmd, r->len - r->cmd);
+    r->len -= r->cmd;
+    r->pos -= r->cmd;
+    r->scan -= (r->depth > 0 || r->part ? r->cmd : 0);
+    r->cmd = 0;
+  }
+  if (r->len + n + 1 > r->cap) {
+    r->cap = (r->cap * 2 > r->len + n + 1 ? r->cap * 2 : r->len + n + 1);
+    r->buf = tcl_realloc(&tcl_heap, r->buf, r->cap);
+  }
+  memcpy(r->buf + r->len, s, n);
+  r->len += n;
+  r->buf[r->len] = '\0';
+}
+
+/* Returns 1 and the next complete command, 0 if more input is needed or -1
+ * if the command is invalid, in which case it's dropped up to the next
+ * command terminator */
+int tcl_reader_next(struct tcl_reader *r, const char **cmd, size_t *len) {
+  for (;;) {
+    if (r->skip) {
+      for (; r->pos < r->len && !tcl_is_end(r->buf[r->pos]); r->pos++) {
+      }
+      if (r->pos == r->len) {
+        r->cmd = r->pos;
+        return 0;
+      }
+      r->cmd = ++r->pos;
+      r->skip = 0;
+    }
+    if (r->depth > 0) {
+      r->scan += tcl_find_close(r->buf + r->scan, r->len - r->scan,
+                                r->buf[r->pos], &r->depth);
+      if (r->depth > 0) {
+        return 0;
+      }
+    } else if (r->part) {
+      /* Variable names end at the same characters as unquoted words */
+      int q = r->q && r->buf[r->pos] != '$';
+      r->scan += (q ? tcl_find(r->buf + r->scan, r->len - r->scan, tcl_stop_q,
+                               sizeof(tcl_stop_q))
+                    : tcl_find(r->buf + r->scan, r->len - r->scan, tcl_stop,
+                               sizeof(tcl_stop)));
+      if (r->scan == r->len) {
+        return 0;
+      }
+      r->part = 0;
+    }
+    if (r->pos >= r->len) {
+      return 0;
+    }
+    const char *from;
+    const char *to = NULL;
+    int q = r->q;
+    int token = tcl_next(r->buf + r->pos, r->len - r->pos, &from, &to, &q);
+    if (token == TERROR) {
+      if (to != r->buf + r->len) {
+        r->skip = 1;
+        r->q = 0;
+        return -1;
+      }
+      /* Incomplete token, it will be scanned again once it's complete */
+      for (; !r->q && tcl_is_space(r->buf[r->pos]); r->pos++) {
+      }
+      if (r->buf[r->pos] == '[' || (!r->q && r->buf[r->pos] == '{')) {
+        r->depth = 1;
+        r->scan = r->pos + 1;
+      } else if (r->buf[r->pos] != '"') {
+        r->part = 1;
+        r->scan = r->len;
+      }
+      return 0;
+    }
+    r->q = q;
+    r->pos = to - r->buf;
+    if (token == TCMD) {
+      *cmd = r->buf + r->cmd;
+      *len = r->pos - r->cmd;
+      r->cmd = r->pos;
+      return 1;
+    }
+  }
+}
+
+#ifndef TEST
+#define CHUNK 4096
 
-    if (i > buflen - 1) {
-      buf = realloc(buf, buflen += CHUNK);
+#ifndef TCL_DISABLE_IMAGE
+/* "tcl -c image" compiles the script from stdin into an image */
+static int tcl_compile_image(struct tcl *tcl, const char *path) {
+  char *s = NULL;
+  size_t len = 0;
+  size_t n;
+  char buf[CHUNK];
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+    s = realloc(s, len + n + 1);
+    memcpy(s + len, buf, n);
+    len += n;
+  }
+  s = realloc(s, len + 1);
+  s[len] = '\0';
+  void *image = tcl_image_save(tcl, s, len + 1, &n);
+  FILE *f = fopen(path, "wb");
+  int ok = (f != NULL && fwrite(image, 1, n, f) == n);
+  if (f == NULL || fclose(f) != 0 || !ok) {
+    fprintf(stderr, "can't write %s\n", path);
+    ok = 0;
+  }
+  free(image);
+  free(s);
+  return ok ? 0 : 1;
+}
+
+/* "tcl image" runs the image, mapping it into memory if possible */
+static int tcl_run_image(struct tcl *tcl, const char *path) {
+  void *image = NULL;
+  size_t size = 0;
+#ifdef TCL_MMAP
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = (size_t)st.st_size;
+    image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    image = (image == MAP_FAILED ? NULL : image);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#else
+  FILE *f = fopen(path, "rb");
+  if (f != NULL && fseek(f, 0, SEEK_END) == 0 && ftell(f) > 0) {
+    size = (size_t)ftell(f);
+    image = malloc(size);
+    rewind(f);
+    if (fread(image, 1, size, f) != size) {
+      free(image);
+      image = NULL;
     }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+#endif
+  if (image == NULL) {
+    fprintf(stderr, "can't read %s\n", path);
+    return 1;
+  }
+  int r = tcl_image_load(tcl, image, size);
+  if (r == FERROR) {
+    printf("?!\n");
+  }
+  tcl_destroy(tcl);
+#ifdef TCL_MMAP
+  munmap(image, size);
+#else
+  free(image);
+#endif
+  return r == FERROR ? 1 : 0;
+}
+#endif
 
-    if (inp == 0 || inp == EOF) {
+/* Reads the input up to a newline or a full block, so that a line typed on a
+ * terminal is evaluated at once. Input ends at EOF or at a zero byte. */
+static size_t tcl_read_input(char *buf, size_t size, int *done) {
+  size_t n = 0;
+  while (n < size) {
+    int c = getchar();
+    if (c == EOF || c == '\0') {
+      *done = 1;
       break;
     }
+    buf[n++] = (char)c;
+    if (c == '\n') {
+      break;
+    }
+  }
+  return n;
+}
 
-    buf[i++] = inp;
+int main(int argc, char *argv[]) {
+  struct tcl tcl;
+  struct tcl_reader reader;
+  char buf[CHUNK];
+  int done = 0;
 
-    tcl_each(buf, i, 1) {
-      if (p.token == TERROR && (p.to - buf) != i) {
-        memset(buf, 0, buflen);
-        i = 0;
-        break;
-      } else if (p.token == TCMD && *(p.from) != '\0') {
-        int r = tcl_eval(&tcl, buf, strlen(buf));
-        if (r != FERROR) {
-          printf("result> %.*s\n", tcl_length(tcl.result),
-                 tcl_string(tcl.result));
-        } else {
-          printf("?!\n");
-        }
+  tcl_init(&tcl);
+#ifndef TCL_DISABLE_IMAGE
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    int r = tcl_compile_image(&tcl, argv[2]);
+    tcl_destroy(&tcl);
+    return r;
+  } else if (argc > 1) {
+    return tcl_run_image(&tcl, argv[1]);
+  }
+#else
+  (void)argc;
+  (void)argv;
+#endif
+  tcl_reader_init(&reader);
+  while (!done) {
+    size_t n = tcl_read_input(buf, sizeof(buf), &done);
+    const char *cmd;
+    size_t len;
+    int r;
 
-        memset(buf, 0, buflen);
-        i = 0;
-        break;
+    tcl_reader_feed(&reader, buf, n);
+    while ((r = tcl_reader_next(&reader, &cmd, &len)) != 0) {
+      if (r < 0) {
+        continue;
+      }
+      if (tcl_eval(&tcl, cmd, len) != FERROR) {
+        printf("result> %.*s\n", tcl_length(tcl.result),
+               tcl_string(tcl.result));
+      } else {
+        printf("?!\n");
       }
     }
   }
 
-  free(buf);
+  done = (reader.cmd < reader.len);
+  tcl_reader_free(&reader);
 
-  if (i) {
+  if (done) {
     printf("incomplete input\n");
     return -1;
   }
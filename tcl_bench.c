@@ -0,0 +1,236 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+
+#define TEST
+#include "tcl.c"
+
+/* Benchmarks print one line per benchmark in the format used by Go
+ * benchmarks, so the results of two builds can be compared with benchstat:
+ *
+ *   BenchmarkName <TAB> iterations <TAB> N ns/op <TAB> N allocs/op
+ *
+ * Each benchmark runs with doubling iteration counts until it takes at least
+ * BENCH_TIME seconds. An optional argument selects benchmarks by substring. */
+#ifndef BENCH_TIME
+#define BENCH_TIME 0.5
+#endif
+
+static long bench_allocs = 0;
+
+static void *bench_realloc(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  if (ptr == NULL && size > 0) {
+    bench_allocs++;
+  }
+  return tcl_heap_realloc(NULL, ptr, size);
+}
+
+static struct tcl_allocator bench_mem = {bench_realloc, NULL};
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile int bench_sink;
+
+static const char *bench_script =
+    "proc fib {x} {\n"
+    "  if {<= $x 1} {return 1}\n"
+    "  return [+ [fib [- $x 1]] [fib [- $x 2]]]\n"
+    "}\n"
+    "set s {}; set i 0\n"
+    "while {< $i 10} { set s \"$s $i\"; set i [+ $i 1] }\n"
+    "puts \"fib([subst $i]) = [fib $i], list = {$s}\"\n"
+    "set data {lorem ipsum dolor sit amet, consectetur adipiscing elit, sed "
+    "do eiusmod tempor incididunt ut labore et dolore magna aliqua}\n";
+
+static void bench_lexer(struct tcl *tcl) {
+  int n = 0;
+  (void)tcl;
+  tcl_each(bench_script, strlen(bench_script) + 1, 0) { n++; }
+  bench_sink = n;
+}
+
+static void bench_list(struct tcl *tcl) {
+  tcl_value_t *item = tcl_alloc_in(tcl, "item", 4);
+  tcl_value_t *list = tcl_list_alloc_in(tcl);
+  for (int i = 0; i < 100; i++) {
+    list = tcl_list_append(list, item);
+  }
+  bench_sink = tcl_length(list);
+  tcl_free(list);
+  tcl_free(item);
+}
+
+static int bench_nop(struct tcl *tcl, int argc, tcl_value_t **argv,
+                     void *arg) {
+  (void)tcl;
+  (void)argc;
+  (void)argv;
+  (void)arg;
+  return FNORMAL;
+}
+
+static void bench_commands(struct tcl *tcl) {
+  for (int i = 0; i < 1000; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "cmd%d", i);
+    tcl_register_argv(tcl, name, bench_nop, 0, NULL);
+  }
+}
+
+static void bench_bootstrap(struct tcl *tcl) {
+  for (int i = 0; i < 100; i++) {
+    char s[128];
+    snprintf(s, sizeof(s), "proc p%d {x} {return $x}; set v%d %d", i, i, i);
+    tcl_eval(tcl, s, strlen(s) + 1);
+  }
+}
+
+static void bench_clone(struct tcl *tcl) {
+  struct tcl clone;
+  tcl_clone(&clone, tcl);
+  tcl_eval(&clone, "p50 $v50", 9);
+  bench_sink = tcl_int(clone.result);
+  tcl_destroy(&clone);
+}
+
+static char *bench_image = NULL;
+static size_t bench_image_size = 0;
+
+static void bench_save(struct tcl *tcl) {
+  bench_bootstrap(tcl);
+  free(bench_image);
+  bench_image = tcl_image_save(tcl, NULL, 0, &bench_image_size);
+}
+
+static void bench_load(struct tcl *tcl) {
+  struct tcl fresh;
+  (void)tcl;
+  tcl_init_alloc(&fresh, &bench_mem);
+  tcl_image_load(&fresh, bench_image, bench_image_size);
+  tcl_destroy(&fresh);
+}
+
+static struct tcl_coro bench_co;
+
+static void bench_coro_start(struct tcl *tcl) {
+  const char *s = "set i 0; while {1} {set i [+ $i [yield $i]]}";
+  tcl_coro_start(tcl, &bench_co, s, strlen(s) + 1);
+}
+
+static void bench_coro(struct tcl *tcl) {
+  tcl_coro_resume(tcl, &bench_co, NULL);
+  bench_sink = tcl_int(tcl->result);
+}
+
+static void bench_event(struct tcl *tcl, void *arg) {
+  (void)tcl;
+  (*(int *)arg)++;
+}
+
+static void bench_timers(struct tcl *tcl) {
+  int n = 0;
+  for (int i = 0; i < 1000; i++) {
+    tcl_event_post(tcl, 0, bench_event, &n);
+  }
+  tcl_event_update(tcl);
+  bench_sink = n;
+}
+
+static void bench_startup(struct tcl *tcl) {
+  struct tcl fresh;
+  (void)tcl;
+  tcl_init_alloc(&fresh, &bench_mem);
+  bench_bootstrap(&fresh);
+  tcl_destroy(&fresh);
+}
+
+struct bench {
+  const char *name;
+  /* Script or C function to prepare the interpreter */
+  const char *setup;
+  void (*setup_fn)(struct tcl *tcl);
+  /* Script or C function for one iteration */
+  const char *script;
+  void (*fn)(struct tcl *tcl);
+};
+
+static struct bench benchmarks[] = {
+    {"Lexer", NULL, NULL, NULL, bench_lexer},
+    {"VarReadWrite", "set b 1", NULL, "set a $b", NULL},
+    {"Dispatch1000", NULL, bench_commands, "cmd500 a b c", NULL},
+    {"ProcCall", "proc f {x} {set x}", NULL, "f 1", NULL},
+    {"Fib15",
+     "proc fib {x} { if {<= $x 1} {return 1}; "
+     "return [+ [fib [- $x 1]] [fib [- $x 2]]] }",
+     NULL, "fib 15", NULL},
+    {"TailCall1000",
+     "proc count {n acc} {if {<= $n 0} {return $acc}; "
+     "return [count [- $n 1] [+ $acc 1]]}",
+     NULL, "count 1000 0", NULL},
+    {"WhileCount1000", NULL, NULL,
+     "set i 0; while {< $i 1000} {set i [+ $i 1]}", NULL},
+    {"ListAppend100", NULL, NULL, NULL, bench_list},
+    {"CoroResume", NULL, bench_coro_start, NULL, bench_coro},
+    {"Timers1000", NULL, NULL, NULL, bench_timers},
+    {"Clone100Procs", NULL, bench_bootstrap, NULL, bench_clone},
+    {"Startup100Procs", NULL, NULL, NULL, bench_startup},
+    {"LoadImage100Procs", NULL, bench_save, NULL, bench_load},
+    {"NestedSubst50", NULL, NULL,
+     "subst [subst [subst [subst [subst [subst [subst [subst [subst [subst "
+     "[subst [subst [subst [subst [subst [subst [subst [subst [subst [subst "
+     "[subst [subst [subst [subst [subst [subst [subst [subst [subst [subst "
+     "[subst [subst [subst [subst [subst [subst [subst [subst [subst [subst "
+     "[subst [subst [subst [subst [subst [subst [subst [subst [subst [subst "
+     "x]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]",
+     NULL},
+};
+
+static void bench_run(struct bench *b) {
+  struct tcl tcl;
+  long n = 1;
+  double elapsed;
+  tcl_init_alloc(&tcl, &bench_mem);
+  if (b->setup != NULL) {
+    tcl_eval(&tcl, b->setup, strlen(b->setup) + 1);
+  }
+  if (b->setup_fn != NULL) {
+    b->setup_fn(&tcl);
+  }
+  for (;;) {
+    double start = bench_now();
+    bench_allocs = 0;
+    for (long i = 0; i < n; i++) {
+      if (b->fn != NULL) {
+        b->fn(&tcl);
+      } else if (tcl_eval(&tcl, b->script, strlen(b->script) + 1) ==
+                 FERROR) {
+        fprintf(stderr, "%s: evaluation failed\n", b->name);
+        exit(1);
+      }
+    }
+    elapsed = bench_now() - start;
+    if (elapsed >= BENCH_TIME || n >= 1000000000L) {
+      break;
+    }
+    n = n * 2;
+  }
+  printf("Benchmark%s\t%ld\t%.1f ns/op\t%.2f allocs/op\n", b->name, n,
+         elapsed * 1e9 / n, (double)bench_allocs / n);
+  fflush(stdout);
+  tcl_destroy(&tcl);
+}
+
+int main(int argc, char *argv[]) {
+  for (unsigned int i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]);
+       i++) {
+    if (argc < 2 || strstr(benchmarks[i].name, argv[1]) != NULL) {
+      bench_run(&benchmarks[i]);
+    }
+  }
+  return 0;
+}
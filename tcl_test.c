@@ -12,16 +12,52 @@ int status = 0;
 
 #include "tcl_test_lexer.h"
 
+#include "tcl_test_value.h"
+
 #include "tcl_test_subst.h"
 
 #include "tcl_test_flow.h"
 
 #include "tcl_test_math.h"
 
+#include "tcl_test_alloc.h"
+
+#include "tcl_test_reader.h"
+
+#include "tcl_test_stats.h"
+
+#include "tcl_test_pool.h"
+
+#include "tcl_test_clone.h"
+
+#include "tcl_test_image.h"
+
+#include "tcl_test_frames.h"
+
+#include "tcl_test_coro.h"
+
+#include "tcl_test_events.h"
+
+#include "tcl_test_slice.h"
+
+#include "tcl_test_names.h"
+
 int main(void) {
   test_lexer();
+  test_value();
   test_subst();
   test_flow();
   test_math();
+  test_alloc();
+  test_reader();
+  test_stats();
+  test_pool();
+  test_clone();
+  test_image();
+  test_frames();
+  test_coro();
+  test_events();
+  test_slice();
+  test_names();
   return status;
 }
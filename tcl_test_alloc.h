@@ -0,0 +1,194 @@
+#ifndef TCL_TEST_ALLOC_H
+#define TCL_TEST_ALLOC_H
+
+/* Allocator that counts calls and keeps track of the allocated bytes, block
+ * sizes are stored in a header before each block */
+struct counting_allocator {
+  int allocs;
+  int reallocs;
+  int frees;
+  size_t bytes;
+  size_t peak;
+};
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size) {
+  struct counting_allocator *c = (struct counting_allocator *)ctx;
+  size_t *block = (ptr != NULL ? (size_t *)ptr - 2 : NULL);
+  if (block != NULL) {
+    c->bytes -= block[0];
+  }
+  if (size == 0) {
+    c->frees++;
+    free(block);
+    return NULL;
+  }
+  if (ptr == NULL) {
+    c->allocs++;
+  } else {
+    c->reallocs++;
+  }
+  block = realloc(block, size + 2 * sizeof(size_t));
+  block[0] = size;
+  c->bytes += size;
+  if (c->bytes > c->peak) {
+    c->peak = c->bytes;
+  }
+  return block + 2;
+}
+
+/* Runs the script once to compile and cache it, then runs it again and
+ * returns the allocations of the second run */
+static struct counting_allocator measure_eval(const char *setup,
+                                              const char *s) {
+  struct counting_allocator c = {0, 0, 0, 0, 0};
+  struct tcl_allocator mem = {counting_realloc, &c};
+  struct tcl tcl;
+  tcl_init_alloc(&tcl, &mem);
+  tcl_eval(&tcl, setup, strlen(setup) + 1);
+  tcl_eval(&tcl, s, strlen(s) + 1);
+  struct counting_allocator before = c;
+  c.peak = c.bytes;
+  tcl_eval(&tcl, s, strlen(s) + 1);
+  struct counting_allocator used = {c.allocs - before.allocs,
+                                    c.reallocs - before.reallocs,
+                                    c.frees - before.frees, c.bytes,
+                                    c.peak - before.bytes};
+  tcl_destroy(&tcl);
+  return used;
+}
+
+/* Fails if the script needs more allocations (including reallocations) than
+ * the budget, once it's compiled */
+static void check_budget(const char *setup, const char *s, int budget) {
+  struct counting_allocator c = measure_eval(setup, s);
+  if (c.allocs + c.reallocs > budget) {
+    FAIL("Expected at most %d allocations, but found %d mallocs and %d "
+         "reallocs (%s)\n",
+         budget, c.allocs, c.reallocs, s);
+  } else {
+    printf("OK: %s -> %d mallocs, %d reallocs, %d frees, %d peak bytes\n", s,
+           c.allocs, c.reallocs, c.frees, (int)c.peak);
+  }
+}
+
+static void test_alloc(void) {
+  printf("\n");
+  printf("#######################\n");
+  printf("### ALLOCATOR TESTS ###\n");
+  printf("#######################\n");
+  printf("\n");
+
+  const char *scripts[][2] = {
+      {"set x 0; while {< $x 10} {set x [+ $x 1]}; subst $x", "10"},
+      {"proc fib {x} { if {<= $x 1} {return 1} "
+       "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 15",
+       "987"},
+      {"set a {hello world}; set b \"$a $a\"; subst $b$a",
+       "hello world hello worldhello world"},
+      {"proc f {a b} { set c \"$a $b\"; return $c }; f [f 1 2] [f 3 4]",
+       "1 2 3 4"},
+      {"set s {}; set i 0; while {< $i 20} {set s $s$i; set i [+ $i 1]}; "
+       "subst $s",
+       "012345678910111213141516171819"},
+  };
+
+  for (int arena = 0; arena < 2; arena++) {
+    for (unsigned int i = 0; i < sizeof(scripts) / sizeof(scripts[0]); i++) {
+      struct counting_allocator c = {0, 0, 0, 0, 0};
+      struct tcl_allocator mem = {counting_realloc, &c};
+      struct tcl tcl;
+      tcl_init_alloc(&tcl, &mem);
+      if (arena) {
+        tcl_use_arena(&tcl, 256);
+      }
+      check_eval(&tcl, scripts[i][0], (char *)scripts[i][1]);
+      /* Arena memory is reused when the same script runs again */
+      check_eval(&tcl, scripts[i][0], (char *)scripts[i][1]);
+      tcl_destroy(&tcl);
+      if (c.allocs == 0 || c.allocs != c.frees) {
+        FAIL("Expected balanced allocations, but found %d allocs and %d "
+             "frees (%s)\n",
+             c.allocs, c.frees, scripts[i][0]);
+      }
+    }
+  }
+  /* Allocation budgets of the hot paths */
+  check_budget("set a 1", "set a", 0);
+  check_budget("set a 1", "set b $a", 0);
+  check_budget("", "+ 1 2", 0);
+  check_budget("", "expr {1 + 2 * 3}", 0);
+  check_budget("proc f {x} {set x}", "f 1", 0);
+  /* Empty results and small numbers are constants */
+  check_budget("", "== 1 1; subst {}", 0);
+  check_budget("set x 1000", "+ $x 1", 1);
+
+  /* Short strings are kept inline, appending moves them to the heap */
+  struct counting_allocator c = {0, 0, 0, 0, 0};
+  struct tcl_allocator mem = {counting_realloc, &c};
+  tcl_value_t *v = tcl_alloc_mem(&mem, "short", 5);
+  if (c.allocs != 1 || v->s != v->small) {
+    FAIL("Expected a short string to be inline\n");
+  }
+  v = tcl_append_string(v, " string that is longer", 22);
+  if (c.allocs != 2 || strcmp(tcl_string(v), "short string that is longer")) {
+    FAIL("Expected a long string on the heap, but found %s\n",
+         tcl_string(v));
+  } else {
+    printf("OK: inline strings -> %d allocations\n", c.allocs);
+  }
+  tcl_free(v);
+  if (c.frees != c.allocs) {
+    FAIL("Expected balanced allocations, but found %d allocs and %d frees\n",
+         c.allocs, c.frees);
+  }
+  /* Host values outside of an evaluation use the interpreter allocator */
+  struct tcl tcl;
+  tcl_init_alloc(&tcl, &mem);
+  int allocs = c.allocs;
+  tcl_value_t *list = tcl_list_alloc_in(&tcl);
+  v = tcl_alloc_in(&tcl, "value", 5);
+  list = tcl_list_append(list, v);
+  tcl_var(&tcl, "x", v);
+  if (c.allocs - allocs < 3 || list->mem != &mem || v->mem != &mem) {
+    FAIL("Expected values from the interpreter allocator\n");
+  } else {
+    printf("OK: host values -> %d allocations\n", c.allocs - allocs);
+  }
+  tcl_free(list);
+  tcl_destroy(&tcl);
+  if (c.frees != c.allocs) {
+    FAIL("Expected balanced allocations, but found %d allocs and %d frees\n",
+         c.allocs, c.frees);
+  }
+  /* Constants are shared and copied before they are changed */
+  v = tcl_append_string(tcl_alloc_wide(7), "x", 1);
+  tcl_value_t *big = tcl_alloc_wide(100);
+  if (tcl_alloc_wide(7) != tcl_alloc_wide(7) || tcl_alloc("", 0)->refs >= 0 ||
+      strcmp(tcl_string(v), "7x") != 0 ||
+      strcmp(tcl_string(tcl_alloc_wide(7)), "7") != 0 ||
+      tcl_int(tcl_alloc_wide(99)) != 99 ||
+      strcmp(tcl_string(big), "100") != 0 || big->refs != 1) {
+    FAIL("Expected immutable constants\n");
+  } else {
+    printf("OK: constants\n");
+  }
+  tcl_free(v);
+  tcl_free(big);
+  /* Counters above the small constants need a new number per iteration */
+  struct counting_allocator loop100 =
+      measure_eval("", "set i 1000; while {< $i 1100} {set i [+ $i 1]}");
+  struct counting_allocator loop200 =
+      measure_eval("", "set i 1000; while {< $i 1200} {set i [+ $i 1]}");
+  allocs = loop200.allocs + loop200.reallocs - loop100.allocs -
+           loop100.reallocs;
+  if (allocs > 100) {
+    FAIL("Expected at most 1 allocation per loop iteration, but found %d in "
+         "100 iterations\n",
+         allocs);
+  } else {
+    printf("OK: while iteration -> %d allocations in 100 iterations\n",
+           allocs);
+  }
+}
+
+#endif /* TCL_TEST_ALLOC_H */
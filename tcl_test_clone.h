@@ -0,0 +1,77 @@
+#ifndef TCL_TEST_CLONE_H
+#define TCL_TEST_CLONE_H
+
+static void test_clone(void) {
+  printf("\n");
+  printf("###################\n");
+  printf("### CLONE TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  struct counting_allocator c = {0, 0, 0, 0, 0};
+  struct tcl_allocator mem = {counting_realloc, &c};
+  struct tcl snapshot;
+  struct tcl a, b, aa;
+  tcl_init_alloc(&snapshot, &mem);
+  check_eval(&snapshot,
+             "proc sq {x} {expr {$x * $x}}; "
+             "proc fib {x} { if {<= $x 1} {return 1}; "
+             "return [+ [fib [- $x 1]] [fib [- $x 2]]] }; "
+             "set greeting hello; set n 5; set l [subst {a b}]",
+             "a b");
+  for (int i = 0; i < 100; i++) {
+    char s[128];
+    snprintf(s, sizeof(s), "proc p%d {} {return %d}; set v%d %d", i, i, i, i);
+    tcl_eval(&snapshot, s, strlen(s) + 1);
+  }
+
+  /* Cloning doesn't depend on the number of commands and variables */
+  tcl_snapshot(&snapshot);
+  int allocs = c.allocs;
+  tcl_clone(&a, &snapshot);
+  if (c.allocs - allocs > 4) {
+    FAIL("Expected at most 4 allocations, but found %d\n", c.allocs - allocs);
+  } else {
+    printf("OK: clone -> %d allocations\n", c.allocs - allocs);
+  }
+  tcl_clone(&b, &snapshot);
+
+  check_eval(&a, "fib 10", "89");
+  check_eval(&a, "sq $n", "25");
+  check_eval(&a, "p42", "42");
+  check_eval(&a, "set v99", "99");
+  check_eval(&a, "set l", "a b");
+  /* Changes are only visible in the clone */
+  check_eval(&a, "set greeting bye; set n [+ $n 1]; set l \"$l c\"", "a b c");
+  check_eval(&a, "proc sq {x} {return 0}; sq 3", "0");
+  check_eval(&b, "subst \"$greeting $n $l [sq 3]\"", "hello 5 a b 9");
+  check_eval(&a, "subst \"$greeting $n $l [sq 3]\"", "bye 6 a b c 0");
+  /* Clones of clones see the changes of their snapshot */
+  tcl_clone(&aa, &a);
+  check_eval(&aa, "subst \"$greeting $n [sq 3] [fib 5]\"", "bye 6 0 8");
+  check_eval(&aa, "proc fib {x} {return -1}; set n 0; fib $n", "-1");
+  /* Snapshots can't be evaluated while they have clones */
+  if (tcl_eval(&a, "set n 7", 8) != FERROR ||
+      tcl_eval(&snapshot, "set n", 6) != FERROR) {
+    FAIL("Expected snapshots with clones to reject evaluation\n");
+  } else {
+    printf("OK: snapshots with clones -> error\n");
+  }
+  tcl_destroy(&aa);
+  check_eval(&a, "subst \"$n [fib 5]\"", "6 8");
+  tcl_destroy(&a);
+  tcl_destroy(&b);
+  check_eval(&snapshot, "subst \"$greeting $n $l [sq 3]\"", "hello 5 a b 9");
+  /* The snapshot frees only the values it froze, not the constants */
+  check_eval(&snapshot,
+             "set n [+ 0 1]; set greeting {}; proc sq {x} {}; "
+             "set l [sq 1]; subst $n$l",
+             "1");
+  tcl_destroy(&snapshot);
+  if (c.allocs != c.frees) {
+    FAIL("Expected balanced allocations, but found %d allocs and %d frees\n",
+         c.allocs, c.frees);
+  }
+}
+
+#endif /* TCL_TEST_CLONE_H */
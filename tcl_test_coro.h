@@ -0,0 +1,143 @@
+#ifndef TCL_TEST_CORO_H
+#define TCL_TEST_CORO_H
+
+static void check_coro(struct tcl *tcl, int r, int flow, const char *expected,
+                       const char *what) {
+  if (r != flow || strcmp(tcl_string(tcl->result), expected) != 0) {
+    FAIL("%s: expected %d '%s', but got %d '%s'\n", what, flow, expected, r,
+         tcl_string(tcl->result));
+  } else {
+    printf("OK: %s -> %d '%s'\n", what, r, expected);
+  }
+}
+
+static void test_coro(void) {
+  printf("\n");
+  printf("#######################\n");
+  printf("### COROUTINE TESTS ###\n");
+  printf("#######################\n");
+  printf("\n");
+
+  struct counting_allocator c = {0, 0, 0, 0, 0};
+  struct tcl_allocator mem = {counting_realloc, &c};
+  struct tcl tcl;
+  struct tcl_coro co;
+  tcl_init_alloc(&tcl, &mem);
+
+  /* Loop state survives across yields */
+  const char *loop =
+      "set i 0; while {< $i 3} {yield $i; set i [+ $i 1]}; subst done";
+  int r = tcl_coro_start(&tcl, &co, loop, strlen(loop) + 1);
+  check_coro(&tcl, r, FYIELD, "0", "start");
+  check_coro(&tcl, tcl_coro_resume(&tcl, &co, NULL), FYIELD, "1", "resume");
+  check_coro(&tcl, tcl_coro_resume(&tcl, &co, NULL), FYIELD, "2", "resume");
+  check_coro(&tcl, tcl_coro_resume(&tcl, &co, NULL), FNORMAL, "done",
+             "finish");
+  check_coro(&tcl, tcl_coro_resume(&tcl, &co, NULL), FERROR, "",
+             "resume finished");
+  tcl_coro_free(&tcl, &co);
+
+  /* Local variables of procedures, resume values are returned by yield */
+  check_eval(&tcl,
+             "proc sum {n} {set s 0; while {> $n 0} "
+             "{set s [+ $s [yield $n]]; set n [- $n 1]}; return $s}",
+             "");
+  const char *sum = "sum 3";
+  r = tcl_coro_start(&tcl, &co, sum, strlen(sum) + 1);
+  check_coro(&tcl, r, FYIELD, "3", "proc start");
+  r = tcl_coro_resume(&tcl, &co, tcl_alloc("10", 2));
+  check_coro(&tcl, r, FYIELD, "2", "proc resume");
+  r = tcl_coro_resume(&tcl, &co, tcl_alloc("20", 2));
+  check_coro(&tcl, r, FYIELD, "1", "proc resume");
+  r = tcl_coro_resume(&tcl, &co, tcl_alloc("30", 2));
+  check_coro(&tcl, r, FNORMAL, "60", "proc finish");
+  tcl_coro_free(&tcl, &co);
+
+  /* Many coroutines in flight */
+  check_eval(&tcl,
+             "proc worker {id} {set k 0; while {< $k 3} "
+             "{yield $k; set k [+ $k 1]}; return $id}",
+             "");
+  struct tcl_coro cos[100];
+  for (int i = 0; i < 100; i++) {
+    char s[32];
+    snprintf(s, sizeof(s), "worker %d", i);
+    tcl_coro_start(&tcl, &cos[i], s, strlen(s) + 1);
+  }
+  int finished = 0;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 100; i++) {
+      char expected[16];
+      r = tcl_coro_resume(&tcl, &cos[i], NULL);
+      snprintf(expected, sizeof(expected), "%d", round < 2 ? round + 1 : i);
+      if (r == (round < 2 ? FYIELD : FNORMAL) &&
+          strcmp(tcl_string(tcl.result), expected) == 0) {
+        finished += (round == 2);
+      } else {
+        FAIL("Coroutine %d, round %d: got %d '%s'\n", i, round, r,
+             tcl_string(tcl.result));
+      }
+    }
+  }
+  if (finished == 100) {
+    printf("OK: 100 interleaved coroutines\n");
+  }
+  for (int i = 0; i < 100; i++) {
+    tcl_coro_free(&tcl, &cos[i]);
+  }
+
+  /* Tail calls and substitutions in a coroutine */
+  check_eval(&tcl,
+             "proc walk {n} {if {> $n 0} {yield [subst \"n=$n\"]; "
+             "return [walk [- $n 1]]}; return end}",
+             "");
+  const char *walk = "walk 1000";
+  r = tcl_coro_start(&tcl, &co, walk, strlen(walk) + 1);
+  for (int i = 1; i < 1000 && r == FYIELD; i++) {
+    r = tcl_coro_resume(&tcl, &co, NULL);
+  }
+  check_coro(&tcl, r, FYIELD, "n=1", "tail calls");
+  check_coro(&tcl, tcl_coro_resume(&tcl, &co, NULL), FNORMAL, "end",
+             "tail calls finish");
+  tcl_coro_free(&tcl, &co);
+
+  /* Suspended coroutines can be dropped */
+  r = tcl_coro_start(&tcl, &co, sum, strlen(sum) + 1);
+  check_coro(&tcl, r, FYIELD, "3", "drop start");
+  tcl_coro_free(&tcl, &co);
+  check_eval(&tcl, "sum 0", "0");
+
+  /* Only scripts evaluated by coroutines can yield */
+  check_coro(&tcl, tcl_eval(&tcl, "yield 1", 8), FERROR, "", "plain yield");
+  /* Expressions and subst don't evaluate commands on the C stack */
+  const char *nested = "expr {[yield 5] * [subst {[yield 6]}] + 1}";
+  r = tcl_coro_start(&tcl, &co, nested, strlen(nested) + 1);
+  check_coro(&tcl, r, FYIELD, "5", "yield in expression");
+  r = tcl_coro_resume(&tcl, &co, tcl_alloc("7", 1));
+  check_coro(&tcl, r, FYIELD, "6", "yield in subst");
+  r = tcl_coro_resume(&tcl, &co, tcl_alloc("3", 1));
+  check_coro(&tcl, r, FNORMAL, "22", "expression resumed");
+  tcl_coro_free(&tcl, &co);
+
+  /* Coroutine values don't live in the arena of the host */
+  struct tcl host;
+  tcl_init_alloc(&host, &mem);
+  tcl_use_arena(&host, 256);
+  r = tcl_coro_start(&host, &co, loop, strlen(loop) + 1);
+  check_eval(&host, "set a [subst {x y z}]; set a \"$a $a\"", "x y z x y z");
+  check_coro(&host, tcl_coro_resume(&host, &co, NULL), FYIELD, "1",
+             "resume with arena");
+  check_eval(&host, "set i", "1");
+  tcl_coro_free(&host, &co);
+  tcl_destroy(&host);
+
+  tcl_destroy(&tcl);
+  if (c.allocs != c.frees) {
+    FAIL("Expected balanced allocations, but found %d allocs and %d frees\n",
+         c.allocs, c.frees);
+  } else {
+    printf("OK: coroutine allocations are balanced\n");
+  }
+}
+
+#endif /* TCL_TEST_CORO_H */
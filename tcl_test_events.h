@@ -0,0 +1,133 @@
+#ifndef TCL_TEST_EVENTS_H
+#define TCL_TEST_EVENTS_H
+
+#ifndef TCL_DISABLE_EVENTS
+static void event_count(struct tcl *tcl, void *arg) {
+  (void)tcl;
+  (*(int *)arg)++;
+}
+
+static void event_flag(struct tcl *tcl, void *arg) {
+  (void)arg;
+  tcl_var(tcl, "flag", tcl_alloc("1", 1));
+}
+
+/* Waiter of a host loop: an I/O event arrives while the loop waits */
+static void event_waiter(struct tcl *tcl, long ms, void *arg) {
+  (void)ms;
+  (*(int *)arg)++;
+  tcl_event_post(tcl, 0, event_flag, NULL);
+}
+#endif
+
+static void test_events(void) {
+#ifndef TCL_DISABLE_EVENTS
+  printf("\n");
+  printf("###################\n");
+  printf("### EVENT TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  struct tcl tcl;
+  tcl_init(&tcl);
+  /* Timers run in the order they are due */
+  check_eval(&tcl,
+             "set c x; after 20 {set c \"$c 20\"}; after 0 {set c \"$c 0\"}; "
+             "after 10 {set c \"$c 10\"}; after 30 {set done 1}; "
+             "vwait done; set c",
+             "x 0 10 20");
+  check_eval(&tcl, "set u 0; after 0 {set u 1}; update; set u", "1");
+  /* Events added by events run in the next update */
+  check_eval(&tcl, "after 0 {after 0 {set v 2}; set v 1}; update; set v",
+             "1");
+  check_eval(&tcl, "update; set v", "2");
+  /* Events run in the global scope */
+  check_eval(&tcl,
+             "proc later {x} {after 0 {set g $x}; set x local}; set x global; "
+             "later 1; update; set g",
+             "global");
+  check_eval(&tcl,
+             "set w 0; set id [after 0 {set w 1}]; after cancel $id; update; "
+             "set w",
+             "0");
+  if (tcl_eval(&tcl, "after cancel after#999", 23) != FERROR) {
+    FAIL("Expected an error for an unknown event\n");
+  }
+  /* Nothing could set the variable */
+  if (tcl_eval(&tcl, "vwait nothing", 14) != FERROR) {
+    FAIL("Expected an error for vwait without events\n");
+  }
+  /* Waiting doesn't create the variable */
+  if (tcl_name_find(&tcl, "nothing", 7, tcl_hash("nothing", 7)) != NULL) {
+    FAIL("Expected vwait not to create the variable\n");
+  }
+
+  unsigned long long start = tcl_clock_ms();
+  check_eval(&tcl, "after 5", "");
+  if (tcl_clock_ms() - start < 5) {
+    FAIL("Expected to sleep for 5 ms\n");
+  }
+
+  /* Host events */
+  int count = 0;
+  if (tcl_event_timeout(&tcl) != -1) {
+    FAIL("Expected no events\n");
+  }
+  tcl_event_post(&tcl, 0, event_count, &count);
+  unsigned long id = tcl_event_post(&tcl, 1000, event_count, &count);
+  if (tcl_event_timeout(&tcl) != 0 || tcl_event_update(&tcl) != 1 ||
+      count != 1) {
+    FAIL("Expected a due event\n");
+  }
+  long ms = tcl_event_timeout(&tcl);
+  if (ms <= 0 || ms > 1000 || !tcl_event_cancel(&tcl, id) ||
+      tcl_event_cancel(&tcl, id) || tcl_event_timeout(&tcl) != -1) {
+    FAIL("Expected a cancelled event, timeout was %ld\n", ms);
+  } else {
+    printf("OK: host events\n");
+  }
+
+  /* The heap yields events ordered by due time, then by id */
+  srand(1);
+  for (int i = 0; i < 1000; i++) {
+    tcl_event_post(&tcl, rand() % 100, event_count, &count);
+  }
+  int found = 1;
+  for (int i = 0; i < 300; i++) {
+    found = found &&
+            tcl_event_cancel(&tcl, tcl.events[rand() % tcl.nevents].id);
+  }
+  /* Every pending event is found at its heap index */
+  for (int i = 0; i < tcl.nevents; i++) {
+    found = found && tcl_event_pos(&tcl, tcl.events[i].id)->i == i;
+  }
+  if (!found || tcl_event_cancel(&tcl, tcl.nextevent + 1)) {
+    FAIL("Expected events to be found by id\n");
+  }
+  int sorted = (tcl.nevents == 700);
+  struct tcl_event prev = tcl.events[0];
+  while (tcl.nevents > 0) {
+    sorted = sorted && !tcl_event_before(&tcl.events[0], &prev);
+    prev = tcl.events[0];
+    tcl_event_remove(&tcl, 0);
+  }
+  if (!sorted) {
+    FAIL("Expected events in order\n");
+  } else {
+    printf("OK: timer heap order\n");
+  }
+
+  /* A host loop can feed vwait */
+  int waits = 0;
+  tcl_event_waiter(&tcl, event_waiter, &waits);
+  check_eval(&tcl, "vwait flag; set flag", "1");
+  if (waits != 1) {
+    FAIL("Expected the waiter to be called once, but found %d\n", waits);
+  }
+  /* Pending events are freed with the interpreter */
+  tcl_eval(&tcl, "after 10 {set late 1}", 22);
+  tcl_destroy(&tcl);
+#endif
+}
+
+#endif /* TCL_TEST_EVENTS_H */
@@ -1,6 +1,23 @@
 #ifndef TCL_TEST_FLOW_H
 #define TCL_TEST_FLOW_H
 
+/* Command using the list calling convention, returns its last word */
+static int cmd_last(struct tcl *tcl, tcl_value_t *args, void *arg) {
+  (void)arg;
+  return tcl_result(tcl, FNORMAL,
+                    tcl_list_at(args, tcl_list_length(args) - 1));
+}
+
+/* Command using the argv calling convention, joins its words */
+static int cmd_join(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+  (void)arg;
+  tcl_value_t *s = tcl_alloc("", 0);
+  for (int i = 1; i < argc; i++) {
+    s = tcl_append(s, tcl_dup(argv[i]));
+  }
+  return tcl_result(tcl, FNORMAL, s);
+}
+
 static void test_flow(void) {
   printf("\n");
   printf("##########################\n");
@@ -34,6 +51,17 @@ static void test_flow(void) {
   check_eval(NULL, "proc foo {a} { subst $a }; foo hello", "hello");
   check_eval(NULL, "proc foo {} { subst hello; return A; return B;}; foo", "A");
   check_eval(NULL, "set x 1; proc two {} { set x 2;}; two; subst $x", "1");
+  check_eval(NULL,
+             "proc count {n} { set i 0; while {< $i $n} {set i [+ $i 1]}; "
+             "subst $i }; count 10",
+             "10");
+  check_eval(NULL, "proc dyn {} { set name v; set $name 5; subst $v }; dyn",
+             "5");
+  check_eval(NULL, "proc dyn {} { set name v; set $name 5; set v }; dyn", "5");
+  check_eval(NULL,
+             "proc sum {n} { if {<= $n 0} {return 0}; "
+             "return [+ $n [sum [- $n 1]]] }; sum 100",
+             "5050");
   /* Example from Picol */
   check_eval(NULL, "proc fib {x} { if {<= $x 1} {return 1} "
                    "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 20",
@@ -53,6 +81,35 @@ static void test_flow(void) {
                    "continue;}; puts \"I can compute that $a[]x$a = [square "
                    "$a]\" ; set a [+ $a 1]}",
              "0");
+  /* Redefined commands are resolved again at cached call sites */
+  check_eval(&tcl, "proc foo {} {subst A}; proc bar {} {foo}; bar", "A");
+  check_eval(&tcl, "proc foo {} {subst B}; bar", "B");
+  for (int i = 0; i < 300; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "cmd%d", i);
+    tcl_register_argv(&tcl, name, tcl_cmd_subst, 2, NULL);
+  }
+  check_eval(&tcl, "cmd0 foo; cmd123 bar; cmd299 baz", "baz");
+  check_eval(&tcl, "square 5", "25");
+  /* Same script text is compiled once and then re-used from the cache */
+  check_eval(&tcl, "set a [+ $a 1]", "12");
+  check_eval(&tcl, "set a [+ $a 1]", "13");
+  /* Both calling conventions are supported */
+  tcl_register(&tcl, "last", cmd_last, 0, NULL);
+  tcl_register_argv(&tcl, "join", cmd_join, 0, NULL);
+  check_eval(&tcl, "last a b {c d}", "c d");
+  check_eval(&tcl, "join a b c d e f g [last x y] $a", "abcdefgy13");
+  check_eval(&tcl, "proc f {x y} {join $y $x}; f [last 1 2] [join 3 4]",
+             "342");
+  /* Procedure arity is checked before the call */
+  if (tcl_eval(&tcl, "f 1", 4) != FERROR ||
+      tcl_eval(&tcl, "f 1 2 3", 8) != FERROR) {
+    FAIL("Expected error calling f with a wrong number of arguments\n");
+  }
+  check_eval(&tcl, "proc f {} {subst none}; f", "none");
+  if (tcl_eval(&tcl, "f 1 2", 6) != FERROR) {
+    FAIL("Expected redefined f to reject arguments\n");
+  }
 
   tcl_destroy(&tcl);
 }
@@ -0,0 +1,122 @@
+#ifndef TCL_TEST_FRAMES_H
+#define TCL_TEST_FRAMES_H
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <limits.h>
+#include <pthread.h>
+
+static const char *frames_deep[] = {
+    "proc d {n} {if {> $n 0} {return [+ 1 [d [- $n 1]]]}; return 0}; "
+    "d 20000",
+    "proc d {n} {if {== $n 0} {return 0}; expr {[d [- $n 1]] + 1}}; "
+    "d 20000",
+    "proc d {n} {if {== $n 0} {return 20000}; subst {[d [- $n 1]]}}; "
+    "d 20000",
+};
+
+/* Deep recursion in a script doesn't need a deep C stack */
+static void *frames_worker(void *arg) {
+  int *ok = arg;
+  for (unsigned i = 0; i < sizeof(frames_deep) / sizeof(frames_deep[0]);
+       i++) {
+    struct tcl tcl;
+    tcl_init(&tcl);
+    ok[i] = (tcl_eval(&tcl, frames_deep[i], strlen(frames_deep[i]) + 1) !=
+                 FERROR &&
+             strcmp(tcl_string(tcl.result), "20000") == 0);
+    tcl_destroy(&tcl);
+  }
+  return NULL;
+}
+#endif
+
+static void test_frames(void) {
+  printf("\n");
+  printf("####################\n");
+  printf("### FRAMES TESTS ###\n");
+  printf("####################\n");
+  printf("\n");
+
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_t thread;
+  pthread_attr_t attr;
+  size_t size = 64 * 1024;
+  int ok[sizeof(frames_deep) / sizeof(frames_deep[0])] = {0};
+  if (size < PTHREAD_STACK_MIN) {
+    size = PTHREAD_STACK_MIN;
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, size);
+  pthread_create(&thread, &attr, frames_worker, ok);
+  pthread_join(thread, NULL);
+  pthread_attr_destroy(&attr);
+  for (unsigned i = 0; i < sizeof(ok) / sizeof(ok[0]); i++) {
+    if (!ok[i]) {
+      FAIL("Expected recursion on a %d KB stack, (%s)\n", (int)(size / 1024),
+           frames_deep[i]);
+    } else {
+      printf("OK: recursion on a %d KB stack, (%s)\n", (int)(size / 1024),
+             frames_deep[i]);
+    }
+  }
+#endif
+
+  for (int arena = 0; arena < 2; arena++) {
+    struct tcl tcl;
+    tcl_init(&tcl);
+    if (arena) {
+      tcl_use_arena(&tcl, 256);
+    }
+    /* Tail calls run in constant space, beyond the frame limit */
+    check_eval(&tcl,
+               "proc count {n acc} {if {<= $n 0} {return $acc}; "
+               "return [count [- $n 1] [+ $acc 1]]}; count 300000 0",
+               "300000");
+    check_eval(&tcl,
+               "proc down {n} {if {> $n 0} {return [down [- $n 1]]}; "
+               "return done}; down 300000",
+               "done");
+    check_eval(&tcl,
+               "proc spin {n} {while {> $n 0} {return [spin [- $n 1]]}; "
+               "return end}; spin 300000",
+               "end");
+    check_eval(&tcl,
+               "proc even {n} {if {<= $n 0} {return 1}; "
+               "return [odd [- $n 1]]}; "
+               "proc odd {n} {if {<= $n 0} {return 0}; "
+               "return [even [- $n 1]]}; even 200001",
+               "0");
+    check_eval(&tcl, "proc a {x} {return [b $x]}; proc b {x} {+ $x 1}; a 1",
+               "2");
+    check_eval(&tcl, "set r [count 3 4]; subst \"$r [count 2 1]\"", "7 3");
+    /* Runaway recursion fails at the frame limit */
+    const char *runaway[] = {
+        "proc inf {} {inf}; inf; subst ok",
+        "proc sub {} {subst [sub]}; sub; subst ok",
+        "proc ex {} {expr {1 + [ex]}}; ex; subst ok",
+        "proc su {} {subst {$[su]}}; su; subst ok",
+        "proc deep {n} {if {> $n 0} {return [+ 1 [deep [- $n 1]]]}; "
+        "return 0}; deep 200000",
+    };
+    for (unsigned i = 0; i < sizeof(runaway) / sizeof(runaway[0]); i++) {
+      if (tcl_eval(&tcl, runaway[i], strlen(runaway[i]) + 1) != FERROR) {
+        FAIL("Expected an error, but found %s, (%s)\n",
+             tcl_string(tcl.result), runaway[i]);
+      } else {
+        printf("OK: %s -> error\n", runaway[i]);
+      }
+      if (tcl.depth != 0) {
+        FAIL("Expected no frames left, but found %d\n", tcl.depth);
+      }
+    }
+    tcl_destroy(&tcl);
+  }
+
+  /* A redefined return is not a tail call */
+  check_eval(NULL,
+             "proc g {} {subst g}; proc return {x} {subst wrapped}; "
+             "proc f {} {return [g]}; f",
+             "wrapped");
+}
+
+#endif /* TCL_TEST_FRAMES_H */
@@ -0,0 +1,80 @@
+#ifndef TCL_TEST_IMAGE_H
+#define TCL_TEST_IMAGE_H
+
+static void check_image(void *image, size_t size, int flow, char *expected) {
+  struct tcl tcl;
+  tcl_init(&tcl);
+  int r = tcl_image_load(&tcl, image, size);
+  if (r != flow || strcmp(tcl_string(tcl.result), expected) != 0) {
+    FAIL("Expected %d (%s), but found %d (%s)\n", flow, expected, r,
+         tcl_string(tcl.result));
+  } else {
+    printf("OK: image of %d bytes -> %s\n", (int)size, expected);
+  }
+  tcl_destroy(&tcl);
+}
+
+static void test_image(void) {
+#ifndef TCL_DISABLE_IMAGE
+  printf("\n");
+  printf("###################\n");
+  printf("### IMAGE TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  struct tcl tcl;
+  size_t size;
+  const char *s = "set i 0; set s {}; "
+                  "while {< $i 3} {set s \"$s[fib $i]\"; set i [+ $i 1]}; "
+                  "subst \"$greeting [sq $n] [fib 10] $s $i\"";
+  tcl_init(&tcl);
+  check_eval(&tcl,
+             "proc sq {x} {expr {$x * $x}}; "
+             "proc fib {x} { if {<= $x 1} {return 1}; "
+             "return [+ [fib [- $x 1]] [fib [- $x 2]]] }; "
+             "set greeting hello; set n 7",
+             "7");
+  char *image = tcl_image_save(&tcl, s, strlen(s) + 1, &size);
+  tcl_destroy(&tcl);
+
+  /* The same image can be loaded into several interpreters */
+  check_image(image, size, FNORMAL, "hello 49 89 112 3");
+  check_image(image, size, FNORMAL, "hello 49 89 112 3");
+  /* Procedures and globals of the image can be used and replaced */
+  tcl_init(&tcl);
+  tcl_image_load(&tcl, image, size);
+  check_eval(&tcl, "set n [+ $n 1]; sq $n", "64");
+  check_eval(&tcl, "set greeting \"$greeting world\"", "hello world");
+  check_eval(&tcl, "proc sq {x} {return $x}; sq 3", "3");
+  check_eval(&tcl, "fib 5", "8");
+  tcl_destroy(&tcl);
+  free(image);
+
+  /* Images without a script only define procedures and variables */
+  tcl_init(&tcl);
+  check_eval(&tcl, "proc f {a b} {set c \"$a $b\"}; set x {1 2}", "1 2");
+  image = tcl_image_save(&tcl, NULL, 0, &size);
+  tcl_destroy(&tcl);
+  check_image(image, size, FNORMAL, "");
+  tcl_init(&tcl);
+  tcl_image_load(&tcl, image, size);
+  check_eval(&tcl, "f $x 3", "1 2 3");
+  tcl_destroy(&tcl);
+
+  /* Invalid images are rejected */
+  check_image(image, size - 1, FERROR, "");
+  image[0] = 'X';
+  check_image(image, size, FERROR, "");
+  free(image);
+  tcl_init(&tcl);
+  image = tcl_image_save(&tcl, "foo", 4, &size);
+  tcl_destroy(&tcl);
+  ((struct tcl_image *)(void *)image)->version++;
+  check_image(image, size, FERROR, "");
+  ((struct tcl_image *)(void *)image)->version--;
+  check_image(image, size, FERROR, "foo");
+  free(image);
+#endif
+}
+
+#endif /* TCL_TEST_IMAGE_H */
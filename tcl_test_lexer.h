@@ -150,6 +150,68 @@ static void test_lexer(void) {
                    "");
   check_tokens_len("set a {\nhello\n}\n", 16, 4, TWORD, "set", TWORD, "a",
                    TWORD, "{\nhello\n}", TCMD, "");
+
+  /* Long tokens are scanned in blocks, the special character may be at any
+   * offset (on both sides of a block boundary, or in the tail) and must be
+   * found at the same place as by the scalar loop. Every SIMD variant that
+   * the CPU supports is checked, not only the one tcl_find() picks. */
+  char buf[100];
+  struct {
+    const char *name;
+    size_t (*find)(const char *s, size_t n, const char *set, int nset);
+  } finds[] = {
+      {"tcl_find", tcl_find},
+#ifdef TCL_SIMD
+      {"tcl_find_sse2", tcl_find_sse2},
+      {"tcl_find_avx2", tcl_find_avx2},
+#endif
+  };
+  struct {
+    const char *set;
+    int nset;
+  } sets[] = {{tcl_stop, sizeof(tcl_stop)}, {tcl_stop_q, sizeof(tcl_stop_q)}};
+  for (unsigned f = 0; f < sizeof(finds) / sizeof(finds[0]); f++) {
+    int errors = 0;
+#ifdef TCL_SIMD
+    if (finds[f].find == tcl_find_avx2 && !tcl_avx2) {
+      printf("SKIP: %s is not supported by the CPU\n", finds[f].name);
+      continue;
+    }
+#endif
+    for (unsigned k = 0; k < sizeof(sets) / sizeof(sets[0]); k++) {
+      const char *set = sets[k].set;
+      int nset = sets[k].nset;
+      for (size_t n = 0; n <= 96; n++) {
+        for (size_t i = 0; i <= n; i++) {
+          for (int j = 0; j < nset; j++) {
+            /* Unaligned, with a special character right after the end */
+            memset(buf, 'x', sizeof(buf));
+            buf[n + 1] = set[0];
+            if (i < n) {
+              buf[i + 1] = set[j];
+            }
+            size_t found = finds[f].find(buf + 1, n, set, nset);
+            if (found != tcl_find_scalar(buf + 1, n, set, nset) &&
+                errors++ == 0) {
+              FAIL("%s: expected special character %d at %d of %d, but "
+                   "found %d\n",
+                   finds[f].name, set[j], (int)i, (int)n, (int)found);
+            }
+          }
+        }
+      }
+    }
+    if (errors == 0) {
+      printf("OK: %s matches the scalar loop\n", finds[f].name);
+    }
+  }
+  const char *braces = "{aaaaaaaaaaaaaaaa{bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb}"
+                       "cccccccccccccccccccccccccccccccc}";
+  check_tokens(braces, 2, TWORD, braces, TCMD, "");
+  const char *part = "aaaaaaaaaaaaaaaaaaaa aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+  snprintf(buf, sizeof(buf), "\"%s$b\"", part);
+  check_tokens(buf, 5, TPART, "", TPART, part, TPART, "$b", TWORD, "", TCMD,
+               "");
 }
 
 #endif /* TCL_TEST_LEXER_H */
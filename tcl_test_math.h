@@ -23,6 +23,44 @@ static void test_math(void) {
   check_eval(NULL, "/ 7 2", "3");
 
   check_eval(NULL, "set a 5;set b 7; subst [- [* 4 [+ $a $b]] 6]", "42");
+  check_eval(NULL, "* 4294967296 4294967296", "0");
+  check_eval(NULL, "+ 2147483647 1", "2147483648");
+
+  /* Infix expressions */
+  check_eval(NULL, "expr {1 + 2 * 3}", "7");
+  check_eval(NULL, "expr {(1 + 2) * 3}", "9");
+  check_eval(NULL, "expr 1 + 2", "3");
+  check_eval(NULL, "expr {-7 / 2 + -7 % 2 + -(-3)}", "-1");
+  check_eval(NULL, "expr {1 << 40 | 0x0f}", "1099511627791");
+  check_eval(NULL, "expr {~0 ^ 5 & 6}", "-5");
+  check_eval(NULL, "expr {9223372036854775807 + 1}", "-9223372036854775808");
+  check_eval(NULL, "expr {1 < 2 == 2 >= 2 && !0 || 0}", "1");
+  check_eval(NULL, "set a 5; set b 7; expr {4 * ($a + $b) - [- 9 3]}", "42");
+  check_eval(NULL, "set a 5; expr {${a} * $a}", "25");
+  /* Right operand of && and || is evaluated only if needed */
+  check_eval(NULL, "set a 1; expr {0 && [set a 2]}; set a", "1");
+  check_eval(NULL, "set a 1; expr {1 || [set a 2]}; set a", "1");
+  check_eval(NULL, "set a 1; expr {1 && [set a 2]}; set a", "2");
+  /* Compiled expressions are reused, variables are read on each run */
+  check_eval(NULL,
+             "set i 0; set s 0; while {< $i 100} "
+             "{set s [expr {$s + $i * $i}]; set i [expr {$i + 1}]}; set s",
+             "328350");
+  check_eval(NULL, "proc sq {x} {expr {$x * $x}}; + [sq 3] [sq 4]", "25");
+
+  const char *invalid[] = {"expr {1 +}", "expr {(1}", "expr {1 / 0}",
+                           "expr {$}", "expr {[+ 1}", "expr {1 2}", "expr"};
+  for (unsigned int i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    struct tcl tcl;
+    tcl_init(&tcl);
+    if (tcl_eval(&tcl, invalid[i], strlen(invalid[i]) + 1) != FERROR) {
+      FAIL("Expected error, but got %s (%s)\n", tcl_string(tcl.result),
+           invalid[i]);
+    } else {
+      printf("OK: %s -> error\n", invalid[i]);
+    }
+    tcl_destroy(&tcl);
+  }
 }
 
 #endif /* TCL_TEST_MATH_H */
@@ -0,0 +1,62 @@
+#ifndef TCL_TEST_NAMES_H
+#define TCL_TEST_NAMES_H
+
+static struct tcl_name *find_name(struct tcl *tcl, const char *s) {
+  return tcl_name_find(tcl, s, strlen(s), tcl_hash(s, strlen(s)));
+}
+
+static void test_names(void) {
+  printf("\n");
+  printf("##################\n");
+  printf("### NAME TESTS ###\n");
+  printf("##################\n");
+  printf("\n");
+
+  struct tcl tcl;
+  tcl_init(&tcl);
+  check_eval(&tcl, "set x 1; proc x {x} {set y $x}; x 2", "2");
+  /* Commands, globals and locals with the same name share it */
+  struct tcl_name *x = find_name(&tcl, "x");
+  tcl_value_t *name = tcl_alloc("x", 1);
+  struct tcl_cmd *cmd = tcl_lookup(&tcl, name, 2);
+  tcl_free(name);
+  if (x == NULL || cmd == NULL || cmd->name != x ||
+      tcl.env->vars->name != x ||
+      ((struct tcl_proc *)cmd->arg)->locals[0] != x || x->refs != 3) {
+    FAIL("Expected one name for the command, variable and local\n");
+  } else {
+    printf("OK: names are shared\n");
+  }
+
+  /* Names of variables are released with the variables */
+  int n = tcl.nnames;
+  check_eval(&tcl,
+             "proc many {n} {while {> $n 0} {set v$n $n; set n [- $n 1]}; "
+             "return $v50}; many 100",
+             "50");
+  /* Only the procedure name and its locals n and v50 are left */
+  if (tcl.nnames != n + 3 || find_name(&tcl, "v49") != NULL) {
+    FAIL("Expected unused names to be removed, but found %d names\n",
+         tcl.nnames - n);
+  } else {
+    printf("OK: unused names are removed\n");
+  }
+  if (tcl_eval(&tcl, "nothing", 8) != FERROR ||
+      find_name(&tcl, "nothing") != NULL) {
+    FAIL("Expected unknown names not to be interned\n");
+  }
+
+  /* Clones intern only the names that are new to the snapshot */
+  struct tcl clone;
+  tcl_clone(&clone, &tcl);
+  check_eval(&clone, "set x [x 5]; set z $x", "5");
+  if (find_name(&clone, "x") != x || x->refs >= 0 || clone.nnames != 1) {
+    FAIL("Expected the clone to use the names of the snapshot\n");
+  } else {
+    printf("OK: clones share names\n");
+  }
+  tcl_destroy(&clone);
+  tcl_destroy(&tcl);
+}
+
+#endif /* TCL_TEST_NAMES_H */
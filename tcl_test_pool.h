@@ -0,0 +1,110 @@
+#ifndef TCL_TEST_POOL_H
+#define TCL_TEST_POOL_H
+
+#ifdef TCL_POOL
+#include <pthread.h>
+
+static const char *pool_setup =
+    "proc fib {x} { if {<= $x 1} {return 1}; "
+    "return [+ [fib [- $x 1]] [fib [- $x 2]]] }; "
+    "proc sq {x} {expr {$x * $x}}";
+
+static const char *pool_script =
+    "set n [sq 4]; set a {}; while {< $n 20} {set a $a$n; set n [+ $n 1]}; "
+    "subst \"[fib 10] $a\"";
+
+static void pool_init(struct tcl *tcl, void *arg) {
+  tcl_eval(tcl, (const char *)arg, strlen((const char *)arg) + 1);
+}
+
+struct pool_job {
+  struct tcl_pool *pool;
+  int failed;
+};
+
+static void *pool_worker(void *arg) {
+  struct pool_job *job = (struct pool_job *)arg;
+  for (int i = 0; i < 200; i++) {
+    struct tcl *tcl = tcl_pool_acquire(job->pool);
+    char s[32];
+    char expected[32];
+    if (tcl_eval(tcl, pool_script, strlen(pool_script) + 1) == FERROR ||
+        strcmp(tcl_string(tcl->result), "89 16171819") != 0) {
+      job->failed++;
+    }
+    /* New scripts are compiled concurrently, until the cache is full */
+    snprintf(s, sizeof(s), "sq %d", i * 2);
+    snprintf(expected, sizeof(expected), "%d", i * i * 4);
+    if (tcl_eval(tcl, s, strlen(s) + 1) == FERROR ||
+        strcmp(tcl_string(tcl->result), expected) != 0) {
+      job->failed++;
+    }
+    tcl_pool_release(job->pool, tcl);
+  }
+  return NULL;
+}
+#endif
+
+static void test_pool(void) {
+#ifdef TCL_POOL
+  printf("\n");
+  printf("##################\n");
+  printf("### POOL TESTS ###\n");
+  printf("##################\n");
+  printf("\n");
+
+  struct tcl_pool pool;
+  tcl_pool_init(&pool, &tcl_heap, pool_init, (void *)pool_setup);
+  struct tcl *a = tcl_pool_acquire(&pool);
+  struct tcl *b = tcl_pool_acquire(&pool);
+  if (a == b) {
+    FAIL("Expected different interpreters\n");
+  }
+  check_eval(a, pool_script, "89 16171819");
+  check_eval(b, pool_script, "89 16171819");
+  /* Both interpreters run the same frozen code */
+  size_t len = strlen(pool_script) + 1;
+  struct tcl_code *code = tcl_cached(a, pool_script, len);
+  if (code != tcl_cached(b, pool_script, len) || code->refs >= 0) {
+    FAIL("Expected shared compiled script\n");
+  }
+  /* Commands and variables are not shared */
+  check_eval(a, "proc sq {x} {return 0}; set v 1; sq 3", "0");
+  check_eval(b, "set v", "");
+  check_eval(b, "sq 3", "9");
+  check_eval(a, pool_script, "89 012345678910111213141516171819");
+  /* Frozen literals are copied when they are modified */
+  check_eval(a, "set s abc; set s $s$s; set t {a b}; set s $s$t",
+             "abcabca b");
+  check_eval(b, "set s abc", "abc");
+  check_eval(b, "expr {1 + 2} + [expr 3]", "6");
+  tcl_pool_release(&pool, b);
+  if (tcl_pool_acquire(&pool) != b) {
+    FAIL("Expected the released interpreter\n");
+  }
+  tcl_pool_release(&pool, b);
+  /* Interpreters keep their state when they are released */
+  check_eval(a, pool_setup, "");
+  tcl_pool_release(&pool, a);
+
+  /* Several threads run the same script */
+  pthread_t threads[8];
+  struct pool_job jobs[8];
+  for (int i = 0; i < 8; i++) {
+    jobs[i].pool = &pool;
+    jobs[i].failed = 0;
+    pthread_create(&threads[i], NULL, pool_worker, &jobs[i]);
+  }
+  for (int i = 0; i < 8; i++) {
+    pthread_join(threads[i], NULL);
+    if (jobs[i].failed > 0) {
+      FAIL("Thread %d failed %d times\n", i, jobs[i].failed);
+    } else {
+      printf("OK: thread %d\n", i);
+    }
+  }
+  tcl_pool_destroy(&pool);
+#endif
+}
+
+#endif /* TCL_TEST_POOL_H */
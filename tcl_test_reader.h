@@ -0,0 +1,105 @@
+#ifndef TCL_TEST_READER_H
+#define TCL_TEST_READER_H
+
+/* Feeds the script in pieces of the given size and joins the commands */
+static void check_reader(const char *s, size_t step, const char *expected,
+                         int errors) {
+  struct tcl_reader r;
+  tcl_value_t *out = tcl_alloc("", 0);
+  int nerr = 0;
+  tcl_reader_init(&r);
+  for (size_t i = 0; i < strlen(s); i += step) {
+    size_t n = strlen(s) - i < step ? strlen(s) - i : step;
+    const char *cmd;
+    size_t len;
+    int k;
+    tcl_reader_feed(&r, s + i, n);
+    while ((k = tcl_reader_next(&r, &cmd, &len)) != 0) {
+      if (k < 0) {
+        nerr++;
+      } else {
+        out = tcl_append_string(out, "<", 1);
+        out = tcl_append_string(out, cmd, len);
+        out = tcl_append_string(out, ">", 1);
+      }
+    }
+  }
+  if (strcmp(tcl_string(out), expected) != 0 || nerr != errors) {
+    FAIL("Expected %s and %d errors, but got %s and %d (step %d)\n", expected,
+         errors, tcl_string(out), nerr, (int)step);
+  } else {
+    printf("OK: reader step %d -> %s\n", (int)step, expected);
+  }
+  tcl_free(out);
+  tcl_reader_free(&r);
+}
+
+static void test_reader(void) {
+  printf("\n");
+  printf("####################\n");
+  printf("### READER TESTS ###\n");
+  printf("####################\n");
+  printf("\n");
+
+  const char *script = "set a 1\nputs \"a b\";proc f {x} {\n  + $x [\n1]\n}\n"
+                       "set b {}";
+  const char *cmds = "<set a 1\n><puts \"a b\";><proc f {x} {\n  + $x [\n1]\n}"
+                     "\n>";
+  for (size_t step = 1; step < 8; step++) {
+    check_reader(script, step, cmds, 0);
+  }
+  check_reader(script, strlen(script), cmds, 0);
+  /* Invalid commands are dropped up to the next command terminator */
+  for (size_t step = 1; step < 20; step += 18) {
+    check_reader("set a }\nset b 2\n", step, "<set b 2\n>", 1);
+    check_reader("set a \"b\"c\nset b 2\n", step, "<set b 2\n>", 1);
+    check_reader("}\nset a 1\nset b 2\n", step, "<set a 1\n><set b 2\n>", 1);
+    check_reader("set a ]; set b 2\n", step, "< set b 2\n>", 1);
+  }
+
+  /* Large nested bodies are read in small pieces */
+  tcl_value_t *body = tcl_alloc("proc f {} {", 11);
+  for (int i = 0; i < 1000; i++) {
+    body = tcl_append_string(body, "if {1} {set a $b}\n", 18);
+  }
+  body = tcl_append_string(body, "}\n", 2);
+  char *expected = malloc(tcl_length(body) + 3);
+  sprintf(expected, "<%s>", tcl_string(body));
+  check_reader(tcl_string(body), 3, expected, 0);
+  free(expected);
+  tcl_free(body);
+
+  /* Long words and strings are not scanned again for every piece */
+  const char *words[] = {"set a ", "set a \"", "set a $"};
+  size_t size = 4 * 1024 * 1024;
+  char *word = malloc(size);
+  for (int i = 0; i < 3; i++) {
+    struct tcl_reader r;
+    const char *cmd = NULL;
+    size_t len = 0;
+    int k = 0;
+    for (size_t j = 0; j < size; j++) {
+      /* Strings have spaces, too */
+      word[j] = (i == 1 && j % 8 == 0 ? ' ' : 'a' + j % 26);
+    }
+    tcl_reader_init(&r);
+    tcl_reader_feed(&r, words[i], strlen(words[i]));
+    for (size_t j = 0; j < size && k == 0; j += 16) {
+      tcl_reader_feed(&r, word + j, 16);
+      k = tcl_reader_next(&r, &cmd, &len);
+    }
+    tcl_reader_feed(&r, (i == 1 ? "\"\n" : "\n"), (i == 1 ? 2 : 1));
+    k = (k == 0 ? tcl_reader_next(&r, &cmd, &len) : -1);
+    if (k != 1 || len != strlen(words[i]) + size + (i == 1 ? 2 : 1)) {
+      FAIL("Expected a command of %d MB (%s...)\n", (int)(size >> 20),
+           words[i]);
+    } else {
+      printf("OK: %d MB word (%s...) in 16 byte pieces\n", (int)(size >> 20),
+             words[i]);
+    }
+    tcl_reader_free(&r);
+  }
+  free(word);
+}
+
+#endif /* TCL_TEST_READER_H */
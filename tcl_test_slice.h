@@ -0,0 +1,113 @@
+#ifndef TCL_TEST_SLICE_H
+#define TCL_TEST_SLICE_H
+
+static void test_slice(void) {
+  printf("\n");
+  printf("###################\n");
+  printf("### SLICE TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  struct counting_allocator c = {0, 0, 0, 0, 0};
+  struct tcl_allocator mem = {counting_realloc, &c};
+  tcl_value_t *list = tcl_alloc_mem(&mem, "", 0);
+  for (int i = 0; i < 100; i++) {
+    char s[32];
+    snprintf(s, sizeof(s), "{item %d} ", i);
+    list = tcl_append_string(list, s, strlen(s));
+  }
+  list = tcl_append_string(list, "12 last", 7);
+
+  /* List items borrow the bytes of the list string */
+  int before = c.allocs + c.reallocs;
+  int n = tcl_list_length(list);
+  int parse = c.allocs + c.reallocs - before;
+  if (n != 102 || parse > n + 8) {
+    FAIL("Expected one allocation per item, but found %d\n", parse);
+  } else {
+    printf("OK: 102 items -> %d allocations\n", parse);
+  }
+  for (int i = 0; i < 100; i++) {
+    char expected[32];
+    tcl_value_t *item = tcl_list_at(list, i);
+    snprintf(expected, sizeof(expected), "item %d", i);
+    if (strcmp(tcl_string(item), expected) != 0) {
+      FAIL("Expected item #%d %s, but found %s\n", i, expected,
+           tcl_string(item));
+    }
+    tcl_free(item);
+  }
+  tcl_value_t *num = tcl_list_at(list, 100);
+  tcl_value_t *last = tcl_list_at(list, 101);
+  before = c.allocs + c.reallocs;
+  if (tcl_int(num) != 12 || strcmp(tcl_string(last), "last") != 0 ||
+      c.allocs + c.reallocs != before) {
+    FAIL("Expected numbers and terminated slices without copies\n");
+  } else {
+    printf("OK: slices without copies\n");
+  }
+
+  /* Slices are copied when they are changed, and outlive the list */
+  tcl_value_t *item = tcl_list_at(list, 1);
+  item = tcl_append_string(item, "!", 1);
+  tcl_value_t *first = tcl_list_at(list, 0);
+  tcl_free(list);
+  if (strcmp(tcl_string(item), "item 1!") != 0 ||
+      strcmp(tcl_string(first), "item 0") != 0 ||
+      strcmp(tcl_string(num), "12") != 0) {
+    FAIL("Expected slices to be independent of the list\n");
+  } else {
+    printf("OK: slices after the list is freed\n");
+  }
+  tcl_free(item);
+  tcl_free(first);
+  tcl_free(num);
+  tcl_free(last);
+
+  /* A frozen slice is shared without touching its parent */
+  tcl_value_t *text = tcl_alloc_mem(&mem, "frozen words and more", 21);
+  tcl_value_t *frozen = tcl_slice(&mem, text, text->s, 12);
+  frozen->refs = -1;
+  tcl_value_t *whole = tcl_slice(&mem, frozen, frozen->s, 12);
+  tcl_value_t *part = tcl_slice(&mem, frozen, frozen->s + 7, 5);
+  if (text->refs != 2 || whole != frozen || part->parent != NULL ||
+      strcmp(tcl_string(part), "words") != 0) {
+    FAIL("Expected frozen slices not to share the parent, but found %d "
+         "references\n",
+         text->refs);
+  } else {
+    printf("OK: frozen slices\n");
+  }
+  tcl_free(part);
+  frozen->refs = 1;
+  tcl_free(frozen);
+  tcl_free(text);
+  if (c.allocs != c.frees) {
+    FAIL("Expected balanced allocations, but found %d allocs and %d frees\n",
+         c.allocs, c.frees);
+  }
+
+  /* Literals of compiled scripts are slices of the source */
+  struct tcl tcl;
+  tcl_init(&tcl);
+  const char *s = "proc f {x} {if {> $x 0} {return [f [- $x 1]]}; set x}";
+  struct tcl_code *code = tcl_cached(&tcl, s, strlen(s) + 1);
+  int sliced = 1;
+  for (int i = 0; i < code->nlits; i++) {
+    sliced = sliced && code->lits[i]->parent == code->src;
+  }
+  if (!sliced) {
+    FAIL("Expected literals to be slices of the source\n");
+  } else {
+    printf("OK: %d literals share the source\n", code->nlits);
+  }
+  tcl_eval(&tcl, s, strlen(s) + 1);
+  check_eval(&tcl, "f 3; f 5", "0");
+  check_eval(&tcl, "set b {{a b}}; subst $b", "a b");
+  check_eval(&tcl, "subst {[set b]}", "{a b}");
+  check_eval(&tcl, "subst {[f 2]}", "0");
+  check_eval(&tcl, "expr {[f 2] + [f 1] + 1}", "1");
+  tcl_destroy(&tcl);
+}
+
+#endif /* TCL_TEST_SLICE_H */
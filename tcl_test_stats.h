@@ -0,0 +1,63 @@
+#ifndef TCL_TEST_STATS_H
+#define TCL_TEST_STATS_H
+
+#ifdef TCL_ENABLE_STATS
+static void count_stats(const char *name, const struct tcl_stats *stats,
+                        void *arg) {
+  if (strcmp(name, "f") == 0) {
+    *(struct tcl_stats *)arg = *stats;
+  }
+}
+#endif
+
+static void test_stats(void) {
+#ifdef TCL_ENABLE_STATS
+  printf("\n");
+  printf("###################\n");
+  printf("### STATS TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  struct tcl tcl;
+  struct tcl_stats stats = {0, 0, 0, 0};
+  tcl_init(&tcl);
+  check_eval(&tcl, "proc f {x} {set y [+ $x 1]}; f 1; f 2", "3");
+  tcl_stats(&tcl, count_stats, &stats);
+  if (stats.calls != 2 || stats.max > stats.time) {
+    FAIL("Expected 2 calls of f, but found %lu (time %llu, max %llu)\n",
+         stats.calls, stats.time, stats.max);
+  }
+  /* Statistics are also available to scripts */
+  tcl_eval(&tcl, "stats f", 8);
+  tcl_value_t *item = tcl_list_at(tcl.result, 0);
+  tcl_value_t *calls = tcl_list_at(item, 1);
+  if (tcl_list_length(tcl.result) != 1 || tcl_list_length(item) != 5 ||
+      tcl_int(calls) != 2) {
+    FAIL("Expected statistics of f, but found %s\n", tcl_string(tcl.result));
+  } else {
+    printf("OK: stats f -> %s\n", tcl_string(tcl.result));
+  }
+  tcl_free(calls);
+  tcl_free(item);
+
+  /* Clones count the calls of snapshot commands on their own */
+  struct tcl clone;
+  tcl_clone(&clone, &tcl);
+  check_eval(&clone, "f 1; f 2; f 3", "4");
+  struct tcl_stats cloned = {0, 0, 0, 0};
+  tcl_stats(&clone, count_stats, &cloned);
+  stats.calls = 0;
+  tcl_stats(&tcl, count_stats, &stats);
+  if (cloned.calls != 3 || stats.calls != 2) {
+    FAIL("Expected 3 calls in the clone and 2 in the snapshot, but found "
+         "%lu and %lu\n",
+         cloned.calls, stats.calls);
+  } else {
+    printf("OK: clone stats -> %lu calls\n", cloned.calls);
+  }
+  tcl_destroy(&clone);
+  tcl_destroy(&tcl);
+#endif
+}
+
+#endif /* TCL_TEST_STATS_H */
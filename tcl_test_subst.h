@@ -65,6 +65,15 @@ static void test_subst(void) {
   check_eval(NULL, "set {a \"b\"} hello; subst ${a \"b\"}", "hello");
   check_eval(NULL, "set \"a b\" hello; subst ${a b}", "hello");
 
+  /* Variable names are not limited in length */
+  char script[700];
+  char name[300];
+  memset(name, 'v', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  snprintf(script, sizeof(script), "set %s hello; subst $%s", name, name);
+  check_eval(NULL, script, "hello");
+  check_eval(NULL, "set a b; set b c; subst {$$a}", "c");
+
   check_eval(NULL, "set q {\"}; set msg hello; subst $q$msg$q", "\"hello\"");
   check_eval(NULL, "set q {\"}; subst $q[]hello[]$q", "\"hello\"");
   check_eval(NULL, "set x {\n\thello\n}", "\n\thello\n");
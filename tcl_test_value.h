@@ -0,0 +1,121 @@
+#ifndef TCL_TEST_VALUE_H
+#define TCL_TEST_VALUE_H
+
+static void check_list(tcl_value_t *list, int n, ...) {
+  va_list ap;
+  va_start(ap, n);
+  if (tcl_list_length(list) != n) {
+    FAIL("Expected list length %d, but found %d (%s)\n", n,
+         tcl_list_length(list), tcl_string(list));
+  }
+  for (int i = 0; i < n; i++) {
+    const char *expected = va_arg(ap, const char *);
+    tcl_value_t *item = tcl_list_at(list, i);
+    if (item == NULL || strcmp(tcl_string(item), expected) != 0) {
+      FAIL("Expected item #%d %s, but found %s (%s)\n", i, expected,
+           tcl_string(item), tcl_string(list));
+    }
+    tcl_free(item);
+  }
+  va_end(ap);
+  printf("OK: list %s\n", tcl_string(list));
+}
+
+static tcl_value_t *list_append(tcl_value_t *list, const char *s) {
+  tcl_value_t *item = tcl_alloc(s, strlen(s));
+  list = tcl_list_append(list, item);
+  tcl_free(item);
+  return list;
+}
+
+static void test_value(void) {
+  printf("\n");
+  printf("###################\n");
+  printf("### VALUE TESTS ###\n");
+  printf("###################\n");
+  printf("\n");
+
+  /* Integer form is cached and dropped when the string changes */
+  tcl_value_t *v = tcl_alloc("12", 2);
+  if (tcl_int(v) != 12 || tcl_int(v) != 12) {
+    FAIL("Expected 12, but found %d\n", tcl_int(v));
+  }
+  v = tcl_append(v, tcl_alloc("3", 1));
+  if (tcl_int(v) != 123 || strcmp(tcl_string(v), "123") != 0) {
+    FAIL("Expected 123, but found %d (%s)\n", tcl_int(v), tcl_string(v));
+  }
+  /* Shared values are copied before they are modified */
+  tcl_value_t *dup = tcl_dup(v);
+  dup = tcl_append(dup, tcl_alloc("4", 1));
+  if (strcmp(tcl_string(v), "123") != 0 || tcl_int(dup) != 1234) {
+    FAIL("Expected 123 and 1234, but found %s and %s\n", tcl_string(v),
+         tcl_string(dup));
+  }
+  tcl_free(v);
+  tcl_free(dup);
+
+  /* Lists built by appending and lists parsed from strings */
+  tcl_value_t *list = tcl_list_alloc();
+  check_list(list, 0);
+  list = list_append(list, "foo");
+  list = list_append(list, "bar baz");
+  list = list_append(list, "");
+  check_list(list, 3, "foo", "bar baz", "");
+  tcl_value_t *parsed = tcl_alloc(tcl_string(list), tcl_length(list));
+  check_list(parsed, 3, "foo", "bar baz", "");
+  parsed = list_append(parsed, "qux");
+  check_list(parsed, 4, "foo", "bar baz", "", "qux");
+  tcl_free(parsed);
+  tcl_free(list);
+
+  /* Large values are built by appending */
+  tcl_value_t *s = tcl_alloc("", 0);
+  list = tcl_list_alloc();
+  for (int i = 0; i < 1000; i++) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", i % 10);
+    s = tcl_append_string(s, buf, 1);
+    list = list_append(list, i % 2 ? buf : "a b");
+  }
+  if (tcl_length(s) != 1000 || tcl_string(s)[999] != '9') {
+    FAIL("Expected 1000 characters, but found %d\n", tcl_length(s));
+  }
+  parsed = tcl_alloc(tcl_string(list), tcl_length(list));
+  if (tcl_list_length(list) != 1000 || tcl_list_length(parsed) != 1000) {
+    FAIL("Expected 1000 items, but found %d and %d\n", tcl_list_length(list),
+         tcl_list_length(parsed));
+  }
+  for (int i = 0; i < 1000; i += 333) {
+    tcl_value_t *item = tcl_list_at(parsed, i);
+    char digit[2] = {(char)('0' + i % 10), '\0'};
+    if (strcmp(tcl_string(item), i % 2 ? digit : "a b") != 0) {
+      FAIL("Unexpected item #%d: %s\n", i, tcl_string(item));
+    }
+    tcl_free(item);
+  }
+  tcl_free(s);
+  tcl_free(parsed);
+  tcl_free(list);
+
+  /* List strings are only built on demand, shared lists are copied */
+  list = list_append(tcl_list_alloc(), "a");
+  list = list_append(list, "b c");
+  if (list->s != NULL || tcl_list_length(list) != 2) {
+    FAIL("Expected a list without string form\n");
+  }
+  dup = list_append(tcl_dup(list), "d");
+  check_list(list, 2, "a", "b c");
+  check_list(dup, 3, "a", "b c", "d");
+  /* Nested lists keep their items */
+  tcl_value_t *nested = tcl_list_append(tcl_list_alloc(), dup);
+  nested = tcl_list_append(nested, list);
+  check_list(nested, 2, "a {b c} d", "a {b c}");
+  tcl_value_t *inner = tcl_list_at(nested, 0);
+  check_list(inner, 3, "a", "b c", "d");
+  tcl_free(inner);
+  tcl_free(nested);
+  tcl_free(dup);
+  tcl_free(list);
+}
+
+#endif /* TCL_TEST_VALUE_H */